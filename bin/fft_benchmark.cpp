@@ -0,0 +1,65 @@
+// Copyright (c) 2018-2019, University of Bremen, M. Farzalipour Tabriz
+// Copyrights licensed under the 2-Clause BSD License.
+// See the accompanying LICENSE.txt file for terms.
+
+//thread scaling benchmark of the 3D FFTs (fft, ifft, fft_r2c) of the slabcc
+//compile: make fft_benchmark (use -DFFTW_OMP or -DMKL in the CPP_DEFS for the multithreaded FFTs)
+//usage: ./fft_benchmark [n_rows n_cols n_slices] [repetitions] [max_threads] [planner]
+//the plans are created before the timing, so only the execution of the transforms is measured
+
+#include "slabcc_math.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+int verbosity_level = 0;
+
+int main(int argc, char *argv[]) {
+	const auto argument = [&](const int index, const uword default_value) {
+		return (argc > index) ? static_cast<uword>(stoul(argv[index])) : default_value;
+	};
+	const SizeCube size(argument(1, 96), argument(2, 96), argument(3, 192));
+	const uword repetitions = std::max<uword>(1, argument(4, 20));
+	int max_threads = 1;
+#ifdef _OPENMP
+	max_threads = omp_get_max_threads();
+#endif
+	max_threads = static_cast<int>(argument(5, max_threads));
+	set_fft_planner((argc > 6) ? argv[6] : "estimate");
+
+	arma_rng::set_seed(0);
+	const cube real_data(size, fill::randu);
+	const cx_cube complex_data(real_data, cube(size, fill::randu));
+
+	//seconds per call
+	const auto timing = [repetitions](const auto& transform) {
+		transform();
+		wall_clock timer;
+		timer.tic();
+		for (uword i = 0; i < repetitions; ++i) {
+			transform();
+		}
+		return timer.toc() / repetitions;
+	};
+
+	cout << "grid: " << size.n_rows << "x" << size.n_cols << "x" << size.n_slices << ", repetitions: " << repetitions << endl;
+	cout << "threads     fft (ms)    ifft (ms) fft_r2c (ms)      speedup" << endl;
+	double reference = 0;
+	for (int threads = 1; threads <= max_threads; ++threads) {
+#ifdef _OPENMP
+		omp_set_num_threads(threads);
+#endif
+		const double t_fft = timing([&] { fft(complex_data); });
+		const double t_ifft = timing([&] { ifft(complex_data); });
+		const double t_r2c = timing([&] { fft_r2c(real_data); });
+		const double total = t_fft + t_ifft + t_r2c;
+		if (threads == 1) {
+			reference = total;
+		}
+		cout << setw(7) << threads << fixed << setprecision(2) << setw(13) << 1000 * t_fft << setw(13) << 1000 * t_ifft
+			<< setw(13) << 1000 * t_r2c << setw(13) << reference / total << defaultfloat << endl;
+	}
+
+	return 0;
+}
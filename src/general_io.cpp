@@ -3,6 +3,39 @@
 // See the accompanying LICENSE.txt file for terms.
 
 #include "general_io.hpp"
+#include <cstdint>
+#include <cstring>
+#include <locale>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+#ifdef ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef LZMA
+#include <lzma.h>
+#endif
+
+#ifdef ZSTD
+#include <zstd.h>
+#endif
 
 
 void cli_params::parse(int argc, char *argv[]) {
@@ -215,3 +248,537 @@ void update_loggers() {
 string to_string(const bool& b) {
 	return b ? "yes" : "no";
 }
+
+mapped_file::mapped_file(const string& file_name, const bool private_copy) : private_copy(private_copy) {
+#ifdef _WIN32
+	const HANDLE file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file != INVALID_HANDLE_VALUE) {
+		opened = true;
+		LARGE_INTEGER file_size;
+		if (GetFileSizeEx(file, &file_size) && (file_size.QuadPart > 0)) {
+			const HANDLE mapping = CreateFileMappingA(file, nullptr, private_copy ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+			if (mapping != nullptr) {
+				const void* view = MapViewOfFile(mapping, private_copy ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+				if (view != nullptr) {
+					data_ptr = static_cast<const char*>(view);
+					data_size = static_cast<size_t>(file_size.QuadPart);
+					mapping_handle = mapping;
+					mapped = true;
+				}
+				else {
+					CloseHandle(mapping);
+				}
+			}
+		}
+		file_handle = file;
+	}
+#else
+	const int file = open(file_name.c_str(), O_RDONLY);
+	if (file != -1) {
+		opened = true;
+		struct stat file_stat;
+		if ((fstat(file, &file_stat) == 0) && (file_stat.st_size > 0)) {
+			void* view = mmap(nullptr, file_stat.st_size, private_copy ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_PRIVATE, file, 0);
+			if (view != MAP_FAILED) {
+				madvise(view, file_stat.st_size, MADV_SEQUENTIAL);
+				data_ptr = static_cast<const char*>(view);
+				data_size = file_stat.st_size;
+				mapped = true;
+			}
+		}
+		close(file);
+	}
+#endif
+
+	//the mapping is not possible (e.g. empty files, pipes, special file systems)
+	if (opened && !mapped) {
+		ifstream infile(file_name, ios::binary);
+		buffer.assign(istreambuf_iterator<char>(infile), istreambuf_iterator<char>());
+		data_ptr = buffer.data();
+		data_size = buffer.size();
+	}
+}
+
+mapped_file::~mapped_file() {
+	if (mapped) {
+#ifdef _WIN32
+		UnmapViewOfFile(data_ptr);
+		CloseHandle(mapping_handle);
+#else
+		munmap(const_cast<char*>(data_ptr), data_size);
+#endif
+	}
+#ifdef _WIN32
+	if (file_handle != nullptr) {
+		CloseHandle(file_handle);
+	}
+#endif
+}
+
+file_status::file_status(const string& file_name) {
+#ifdef _WIN32
+	struct _stat64 file_stat;
+	if (_stat64(file_name.c_str(), &file_stat) == 0) {
+		exists = true;
+		size = file_stat.st_size;
+		modification_time = static_cast<int64_t>(file_stat.st_mtime) * 1000000000;
+		char path[_MAX_PATH];
+		full_path = (_fullpath(path, file_name.c_str(), _MAX_PATH) != nullptr) ? path : file_name;
+	}
+#else
+	struct stat file_stat;
+	if (stat(file_name.c_str(), &file_stat) == 0) {
+		exists = true;
+		size = file_stat.st_size;
+		modification_time = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 + file_stat.st_mtim.tv_nsec;
+		char path[PATH_MAX];
+		full_path = (realpath(file_name.c_str(), path) != nullptr) ? path : file_name;
+	}
+#endif
+}
+
+bool is_HDF5_file(const string& file_name) {
+	ifstream in_file(file_name, ios::binary);
+	char signature[8] = {};
+	in_file.read(signature, sizeof(signature));
+	return (in_file.gcount() == sizeof(signature)) && (memcmp(signature, "\x89HDF\r\n\x1A\n", sizeof(signature)) == 0);
+}
+
+compression detect_compression(const string& file_name) {
+	ifstream in_file(file_name, ios::binary);
+	unsigned char magic[6] = {};
+	in_file.read(reinterpret_cast<char*>(magic), sizeof(magic));
+	const auto magic_size = in_file.gcount();
+	if ((magic_size >= 2) && (magic[0] == 0x1F) && (magic[1] == 0x8B)) {
+		return compression::gzip;
+	}
+	if ((magic_size >= 6) && (magic[0] == 0xFD) && (memcmp(magic + 1, "7zXZ", 4) == 0) && (magic[5] == 0x00)) {
+		return compression::xz;
+	}
+	if ((magic_size >= 4) && (magic[0] == 0x28) && (magic[1] == 0xB5) && (magic[2] == 0x2F) && (magic[3] == 0xFD)) {
+		return compression::zstd;
+	}
+	return compression::none;
+}
+
+decompressed_stream::decompressed_stream(const string& file_name, const size_t block_size, const size_t queue_size) :
+	block_size(block_size), queue_size(queue_size) {
+	worker = thread(&decompressed_stream::decompress, this, file_name);
+}
+
+decompressed_stream::~decompressed_stream() {
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		stopped = true;
+	}
+	queue_changed.notify_all();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+bool decompressed_stream::next_block(vector<char>& block) {
+	unique_lock<mutex> lock(queue_mutex);
+	queue_changed.wait(lock, [this] { return finished || !blocks.empty(); });
+	if (blocks.empty()) {
+		return false;
+	}
+	block = move(blocks.front());
+	blocks.pop_front();
+	queue_changed.notify_all();
+	return true;
+}
+
+bool decompressed_stream::failed() const {
+	lock_guard<mutex> lock(queue_mutex);
+	return !error.empty();
+}
+
+string decompressed_stream::error_message() const {
+	lock_guard<mutex> lock(queue_mutex);
+	return error;
+}
+
+bool decompressed_stream::push(const char* data, size_t size, vector<char>& pending, const bool flush) {
+	while ((size > 0) || (flush && !pending.empty())) {
+		const size_t part = std::min(size, block_size - pending.size());
+		pending.insert(pending.end(), data, data + part);
+		data += part;
+		size -= part;
+		if ((pending.size() == block_size) || (flush && (size == 0))) {
+			unique_lock<mutex> lock(queue_mutex);
+			queue_changed.wait(lock, [this] { return stopped || (blocks.size() < queue_size); });
+			if (stopped) {
+				return false;
+			}
+			blocks.push_back(move(pending));
+			pending = vector<char>();
+			pending.reserve(block_size);
+			queue_changed.notify_all();
+		}
+	}
+	lock_guard<mutex> lock(queue_mutex);
+	return !stopped;
+}
+
+void decompressed_stream::decompress(const string& file_name) {
+	string failure;
+	vector<char> pending;
+	pending.reserve(block_size);
+	const size_t buffer_size = 1 << 20;
+	vector<char> input(buffer_size), output(buffer_size);
+	ifstream in_file(file_name, ios::binary);
+
+	const compression format = detect_compression(file_name);
+	if (!in_file) {
+		failure = "File not found: " + file_name;
+	}
+	else if (format == compression::gzip) {
+#ifdef ZLIB
+		z_stream stream{};
+		//automatic detection of the gzip/zlib header
+		int status = inflateInit2(&stream, 15 + 32);
+		bool reader_stopped = false;
+		bool output_full = false;
+		//Z_BUF_ERROR: no progress was possible without more input (e.g. the output buffer was filled by the last input byte)
+		while (!reader_stopped && ((status == Z_OK) || (status == Z_STREAM_END) || (status == Z_BUF_ERROR))) {
+			//a full output buffer may leave some data inside the decoder
+			if ((stream.avail_in == 0) && !output_full) {
+				in_file.read(input.data(), input.size());
+				stream.avail_in = static_cast<uInt>(in_file.gcount());
+				stream.next_in = reinterpret_cast<Bytef*>(input.data());
+				if (stream.avail_in == 0) break;
+			}
+			//concatenated gzip members
+			if (status == Z_STREAM_END) {
+				inflateReset(&stream);
+			}
+			stream.next_out = reinterpret_cast<Bytef*>(output.data());
+			stream.avail_out = static_cast<uInt>(output.size());
+			status = inflate(&stream, Z_NO_FLUSH);
+			output_full = (stream.avail_out == 0) && (status != Z_STREAM_END);
+			reader_stopped = !push(output.data(), output.size() - stream.avail_out, pending, false);
+		}
+		if (!reader_stopped && (status != Z_STREAM_END)) {
+			failure = file_name + " is not a valid gzip file or it is truncated";
+		}
+		inflateEnd(&stream);
+#else
+		failure = "Support for the gzip compressed files is not enabled in this build (-DZLIB): " + file_name;
+#endif
+	}
+	else if (format == compression::xz) {
+#ifdef LZMA
+		lzma_stream stream = LZMA_STREAM_INIT;
+		lzma_ret status = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+		lzma_action action = LZMA_RUN;
+		bool reader_stopped = false;
+		while (!reader_stopped && (status == LZMA_OK)) {
+			if ((stream.avail_in == 0) && (action == LZMA_RUN)) {
+				in_file.read(input.data(), input.size());
+				stream.avail_in = static_cast<size_t>(in_file.gcount());
+				stream.next_in = reinterpret_cast<const uint8_t*>(input.data());
+				if (stream.avail_in == 0) {
+					action = LZMA_FINISH;
+				}
+			}
+			stream.next_out = reinterpret_cast<uint8_t*>(output.data());
+			stream.avail_out = output.size();
+			status = lzma_code(&stream, action);
+			reader_stopped = !push(output.data(), output.size() - stream.avail_out, pending, false);
+		}
+		if (!reader_stopped && (status != LZMA_STREAM_END)) {
+			failure = file_name + " is not a valid xz file or it is truncated";
+		}
+		lzma_end(&stream);
+#else
+		failure = "Support for the xz compressed files is not enabled in this build (-DLZMA): " + file_name;
+#endif
+	}
+	else if (format == compression::zstd) {
+#ifdef ZSTD
+		ZSTD_DCtx* const context = ZSTD_createDCtx();
+		size_t status = 0;
+		bool reader_stopped = false;
+		while (!reader_stopped && failure.empty()) {
+			in_file.read(input.data(), input.size());
+			ZSTD_inBuffer in_buffer = { input.data(), static_cast<size_t>(in_file.gcount()), 0 };
+			if (in_buffer.size == 0) break;
+			ZSTD_outBuffer out_buffer = { output.data(), output.size(), 0 };
+			//the output buffer may be filled before consuming the whole input
+			while (!reader_stopped && ((in_buffer.pos < in_buffer.size) || (out_buffer.pos == out_buffer.size))) {
+				out_buffer.pos = 0;
+				status = ZSTD_decompressStream(context, &out_buffer, &in_buffer);
+				if (ZSTD_isError(status)) {
+					failure = file_name + " is not a valid zstd file: " + ZSTD_getErrorName(status);
+					break;
+				}
+				reader_stopped = !push(output.data(), out_buffer.pos, pending, false);
+			}
+		}
+		//status is 0 only at the end of a complete frame
+		if (!reader_stopped && failure.empty() && (status != 0)) {
+			failure = file_name + " is truncated";
+		}
+		ZSTD_freeDCtx(context);
+#else
+		failure = "Support for the zstd compressed files is not enabled in this build (-DZSTD): " + file_name;
+#endif
+	}
+	else {
+		failure = file_name + " is not compressed with any of the supported formats (gzip, xz, zstd)";
+	}
+
+	push(nullptr, 0, pending, true);
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		finished = true;
+		error = failure;
+	}
+	queue_changed.notify_all();
+}
+
+bool write_file_atomically(const string& file_name, const vector<pair<const char*, size_t>>& content) {
+#ifdef _WIN32
+	const string temp_file = file_name + ".tmp" + to_string(_getpid());
+#else
+	const string temp_file = file_name + ".tmp" + to_string(getpid());
+#endif
+	{
+		ofstream out_file(temp_file, ios::binary | ios::trunc);
+		for (const auto& part : content) {
+			out_file.write(part.first, part.second);
+		}
+		if (!out_file) {
+			out_file.close();
+			remove(temp_file.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	const bool renamed = MoveFileExA(temp_file.c_str(), file_name.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const bool renamed = rename(temp_file.c_str(), file_name.c_str()) == 0;
+#endif
+	if (!renamed) {
+		remove(temp_file.c_str());
+	}
+	return renamed;
+}
+
+namespace {
+	inline bool is_space(const char c) noexcept {
+		return (c == ' ') || (c == '\n') || (c == '\r') || (c == '\t') || (c == '\v') || (c == '\f');
+	}
+
+	inline bool is_digit(const char c) noexcept {
+		return (c >= '0') && (c <= '9');
+	}
+
+	//powers of 10 which are exactly representable as double
+	constexpr double exact_powers_of_10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+}
+
+bool parse_double(const char*& pos, const char* end, double& value) noexcept {
+	const char* p = pos;
+	while ((p != end) && is_space(*p)) ++p;
+	const char* const number_start = p;
+
+	bool negative = false;
+	if ((p != end) && ((*p == '-') || (*p == '+'))) {
+		negative = (*p == '-');
+		++p;
+	}
+
+	// up to 19 significant digits fit in the 64-bit mantissa
+	uint64_t mantissa = 0;
+	int significant_digits = 0;
+	int exponent = 0;
+	bool has_digits = false;
+	bool truncated = false;
+	while ((p != end) && is_digit(*p)) {
+		has_digits = true;
+		if (significant_digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa != 0) ++significant_digits;
+		}
+		else {
+			truncated |= (*p != '0');
+			++exponent;
+		}
+		++p;
+	}
+	if ((p != end) && (*p == '.')) {
+		++p;
+		while ((p != end) && is_digit(*p)) {
+			has_digits = true;
+			if (significant_digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0) ++significant_digits;
+				--exponent;
+			}
+			else {
+				truncated |= (*p != '0');
+			}
+			++p;
+		}
+	}
+	if (!has_digits) {
+		return false;
+	}
+	const char* const mantissa_end = p;
+
+	if ((p != end) && ((*p == 'e') || (*p == 'E') || (*p == 'd') || (*p == 'D') || (*p == '-') || (*p == '+'))) {
+		const char* q = p;
+		if ((*q != '-') && (*q != '+')) ++q;
+		bool negative_exponent = false;
+		if ((q != end) && ((*q == '-') || (*q == '+'))) {
+			negative_exponent = (*q == '-');
+			++q;
+		}
+		if ((q == end) || !is_digit(*q)) {
+			return false;
+		}
+		int exponent_value = 0;
+		while ((q != end) && is_digit(*q)) {
+			if (exponent_value < 100000) {
+				exponent_value = exponent_value * 10 + (*q - '0');
+			}
+			++q;
+		}
+		exponent += negative_exponent ? -exponent_value : exponent_value;
+		p = q;
+	}
+	if ((p != end) && !is_space(*p)) {
+		return false;
+	}
+
+	if (mantissa == 0 && !truncated) {
+		value = negative ? -0.0 : 0.0;
+	}
+	else if (!truncated && (mantissa <= (uint64_t(1) << 53)) && (exponent >= -22) && (exponent <= 22)) {
+		//both the mantissa and the power of 10 are exact: the result is correctly rounded
+		value = static_cast<double>(mantissa);
+		value = (exponent < 0) ? value / exact_powers_of_10[-exponent] : value * exact_powers_of_10[exponent];
+		if (negative) value = -value;
+	}
+	else {
+		//slow path: parse a C-style copy of the number with the classic locale (strtod depends on the global locale)
+		char number[128];
+		const size_t mantissa_length = mantissa_end - number_start;
+		const size_t exponent_length = p - mantissa_end;
+		if (mantissa_length + exponent_length + 2 > sizeof(number)) {
+			return false;
+		}
+		memcpy(number, number_start, mantissa_length);
+		size_t length = mantissa_length;
+		if (exponent_length > 0) {
+			number[length++] = 'e';
+			const char* exponent_start = mantissa_end;
+			if ((*exponent_start != '-') && (*exponent_start != '+')) ++exponent_start;
+			memcpy(number + length, exponent_start, p - exponent_start);
+			length += p - exponent_start;
+		}
+		istringstream number_stream(string(number, length));
+		number_stream.imbue(locale::classic());
+		number_stream >> value;
+		if (number_stream.fail() || (number_stream.peek() != char_traits<char>::eof())) {
+			return false;
+		}
+	}
+
+	pos = p;
+	return true;
+}
+
+namespace {
+	uword parse_doubles_in_chunks(const char* begin, const char* end, double* values, const uword count) {
+		//minimum size of the chunk for each thread
+		const size_t min_chunk_size = 1 << 20;
+		size_t chunks_number = 1;
+	#ifdef _OPENMP
+		chunks_number = 4 * omp_get_max_threads();
+	#endif
+		chunks_number = std::max<size_t>(1, std::min<size_t>(chunks_number, (end - begin) / min_chunk_size));
+
+		// split the range at the whitespaces
+		vector<const char*> chunk_bounds(chunks_number + 1, end);
+		chunk_bounds.at(0) = begin;
+		for (size_t i = 1; i < chunks_number; ++i) {
+			const char* bound = std::max(begin + (end - begin) / chunks_number * i, chunk_bounds.at(i - 1));
+			while ((bound != end) && !is_space(*bound)) ++bound;
+			chunk_bounds.at(i) = bound;
+		}
+
+		// 1st pass: number of the tokens in each chunk
+		vector<uword> first_token(chunks_number + 1, 0);
+	#pragma omp parallel for schedule(static, 1)
+		for (size_t chunk = 0; chunk < chunks_number; ++chunk) {
+			uword tokens = 0;
+			bool in_token = false;
+			for (const char* p = chunk_bounds.at(chunk); p != chunk_bounds.at(chunk + 1); ++p) {
+				const bool space = is_space(*p);
+				tokens += (!space && !in_token);
+				in_token = !space;
+			}
+			first_token.at(chunk + 1) = tokens;
+		}
+		for (size_t chunk = 0; chunk < chunks_number; ++chunk) {
+			first_token.at(chunk + 1) += first_token.at(chunk);
+		}
+
+		// 2nd pass: parse the numbers directly into their final position
+		vector<uword> parsed(chunks_number, 0);
+	#pragma omp parallel for schedule(static, 1)
+		for (size_t chunk = 0; chunk < chunks_number; ++chunk) {
+			const char* p = chunk_bounds.at(chunk);
+			const uword last_token = std::min(first_token.at(chunk + 1), count);
+			uword token = first_token.at(chunk);
+			while ((token < last_token) && parse_double(p, chunk_bounds.at(chunk + 1), values[token])) {
+				++token;
+			}
+			parsed.at(chunk) = token;
+		}
+
+		for (size_t chunk = 0; chunk < chunks_number; ++chunk) {
+			const uword last_token = std::min(first_token.at(chunk + 1), count);
+			if (parsed.at(chunk) < last_token) {
+				return parsed.at(chunk);
+			}
+		}
+
+		return std::min(first_token.at(chunks_number), count);
+	}
+}
+
+uword parse_doubles(const char* begin, const char* end, double* values, const uword count) {
+	if (count == 0) {
+		return 0;
+	}
+
+	//the range may contain much more data than requested (e.g. the next datasets in the file)
+	//tokenize only the estimated length of the requested data in the first try
+	const uword sample_tokens = 64;
+	const char* sample_end = begin;
+	uword sampled = 0;
+	while ((sample_end != end) && (sampled < sample_tokens)) {
+		while ((sample_end != end) && is_space(*sample_end)) ++sample_end;
+		if (sample_end == end) break;
+		while ((sample_end != end) && !is_space(*sample_end)) ++sample_end;
+		++sampled;
+	}
+	if ((sampled == sample_tokens) && (count > sample_tokens)) {
+		const double estimated_length = 1.1 * (sample_end - begin) * count / sample_tokens + 65536;
+		if (estimated_length < end - begin) {
+			const char* estimated_end = begin + static_cast<size_t>(estimated_length);
+			while ((estimated_end != end) && !is_space(*estimated_end)) ++estimated_end;
+			const uword parsed = parse_doubles_in_chunks(begin, estimated_end, values, count);
+			if (parsed == count) {
+				return parsed;
+			}
+		}
+	}
+
+	return parse_doubles_in_chunks(begin, end, values, count);
+}
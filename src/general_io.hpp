@@ -10,6 +10,11 @@
 #include "nlopt.hpp"
 #include "sinks/basic_file_sink.h"
 #include "sinks/stdout_color_sinks.h"
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 using namespace std;
 
@@ -67,5 +72,121 @@ void prepare_output_file(string& output_file);
 // bool to yes/no conversion
 string to_string(const bool& b);
 
+//read-only view of the whole content of a file
+//the file is memory-mapped if possible, otherwise its content is read into a buffer
+//with private_copy, the content can also be modified through data() without changing the file (copy-on-write)
+struct mapped_file {
+	explicit mapped_file(const string& file_name, const bool private_copy = false);
+	~mapped_file();
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool is_open() const noexcept { return opened; }
+	const char* begin() const noexcept { return data_ptr; }
+	const char* end() const noexcept { return data_ptr + data_size; }
+	size_t size() const noexcept { return data_size; }
+	char* data() const noexcept { return private_copy ? const_cast<char*>(data_ptr) : nullptr; }
+
+private:
+	bool opened = false;
+	bool private_copy = false;
+	bool mapped = false;
+	const char* data_ptr = nullptr;
+	size_t data_size = 0;
+	vector<char> buffer;		//file content if the memory mapping is not possible
+	void* file_handle = nullptr;	//Windows handles of the file and its mapping object
+	void* mapping_handle = nullptr;
+};
+
+//size, modification time and the full path of a file
+struct file_status {
+	bool exists = false;
+	uint64_t size = 0;
+	int64_t modification_time = 0;	//nanoseconds since epoch (seconds resolution on Windows)
+	string full_path;
+
+	explicit file_status(const string& file_name);
+};
+
+//writes the content to a temporary file next to the file_name and renames it to the file_name
+//concurrent readers see either the old file or the complete new one
+//returns false on failure
+bool write_file_atomically(const string& file_name, const vector<pair<const char*, size_t>>& content);
+
+//the file has the HDF5 signature
+bool is_HDF5_file(const string& file_name);
+
+//compression format of a file, detected by its magic number
+enum class compression { none, gzip, xz, zstd };
+compression detect_compression(const string& file_name);
+
+//decompresses a gzip/xz/zstd file on its own thread
+//the decompressed data is passed to the reader in blocks through a bounded queue, so decoding and parsing overlap
+//the support for each format must be enabled at the compile time: -DZLIB, -DLZMA, -DZSTD
+struct decompressed_stream {
+	explicit decompressed_stream(const string& file_name, const size_t block_size = 4 << 20, const size_t queue_size = 4);
+	~decompressed_stream();
+	decompressed_stream(const decompressed_stream&) = delete;
+	decompressed_stream& operator=(const decompressed_stream&) = delete;
+
+	//moves the next decompressed block into the "block"
+	//returns false at the end of the data or on errors
+	bool next_block(vector<char>& block);
+
+	//the file could not be opened/decompressed. error_message() describes the reason
+	bool failed() const;
+	string error_message() const;
+
+private:
+	const size_t block_size;
+	const size_t queue_size;
+	deque<vector<char>> blocks;
+	bool finished = false;	//no more blocks will be added
+	bool stopped = false;	//the reader does not need any more blocks
+	string error;
+	mutable mutex queue_mutex;
+	condition_variable queue_changed;
+	thread worker;
+
+	//runs on the worker thread
+	void decompress(const string& file_name);
+
+	//adds the data to the queue in blocks. Returns false if the reader has stopped
+	bool push(const char* data, size_t size, vector<char>& pending, const bool flush);
+};
+
+//read-only stream buffer over a memory range
+//can be used for constructing an istream on the data without copying it
+struct memory_buffer : public streambuf {
+	memory_buffer(const char* begin, const char* end) {
+		char* const first = const_cast<char*>(begin);
+		setg(first, first, const_cast<char*>(end));
+	}
+
+protected:
+	pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which = ios_base::in) override {
+		char* const target = (dir == ios_base::beg) ? eback() + off : (dir == ios_base::cur) ? gptr() + off : egptr() + off;
+		if (!(which & ios_base::in) || (target < eback()) || (target > egptr())) {
+			return pos_type(off_type(-1));
+		}
+		setg(eback(), target, egptr());
+		return pos_type(target - eback());
+	}
+
+	pos_type seekpos(pos_type pos, ios_base::openmode which = ios_base::in) override {
+		return seekoff(off_type(pos), ios_base::beg, which);
+	}
+};
+
+//reads a floating point number independent of the locale setting and moves the pos to the end of it
+//also accepts the Fortran-style numbers without the exponent character (e.g. 0.123-100)
+//returns false if there is not a valid number at the pos
+bool parse_double(const char*& pos, const char* end, double& value) noexcept;
+
+//reads the first "count" whitespace-separated numbers in the [begin end) range into the "values" array
+//the range is split into chunks which are tokenized and parsed in parallel
+//returns the number of the values which has been read successfully
+uword parse_doubles(const char* begin, const char* end, double* values, const uword count);
+
 
 
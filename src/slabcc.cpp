@@ -59,6 +59,15 @@ int main(int argc, char *argv[]){
 	bool optimize_interfaces = false;		//optimize the position of interfaces
 	bool extrapolate = false;	//use the extrapolation for E-isolated calculations
 	bool model_2D = false;		//the model is 2D
+	bool grid_cache = false;	//use the binary cache files of the parsed CHGCAR/LOCPOT files
+	bool output_hdf5 = false;	//write the slabcc_D and slabcc_M files in the HDF5 format
+	bool charge_reciprocal = false;	//generate the model charges in the reciprocal space
+	bool optimize_single_precision = false;	//single precision FFTs and solvers during the optimization
+	string fft_planner = "";	//FFTW planner level: estimate, measure, patient
+	string fft_wisdom = "";		//FFTW wisdom file
+	string interpolation = "";	//resampling method of the target potential: spline, fourier
+	string poisson_solver = "";	//linear solver of the Poisson equation: direct, eigen, banded, iterative, multigrid
+	int poisson_bandwidth = 0;	//bandwidth of the dielectric spectrum in the banded Poisson solver
 	
 	// parameters read from the input file
 	const input_data inputfile_variables = {
@@ -66,7 +75,7 @@ int main(int argc, char *argv[]){
 		opt_algo, charge_position, charge_fraction, charge_sigma, charge_rotations, slabcenter, diel_in, diel_out,
 		normal_direction, interfaces, diel_erf_beta,
 		opt_tol, optimize, optimize_charge_position, optimize_charge_sigma, optimize_charge_rotation, optimize_charge_fraction, optimize_interfaces, extrapolate, model_2D, charge_trivariate, opt_grid_x,
-		extrapol_grid_x, max_eval, max_time, extrapol_steps_num, extrapol_steps_size };
+		extrapol_grid_x, max_eval, max_time, extrapol_steps_num, extrapol_steps_size, grid_cache, output_hdf5, charge_reciprocal, optimize_single_precision, fft_planner, fft_wisdom, interpolation, poisson_solver, poisson_bandwidth };
 
 	inputfile_variables.parse(input_file);
 	if (!output_diffs_only) {
@@ -82,32 +91,59 @@ int main(int argc, char *argv[]){
 	log->debug("SLABCC output file: {}", output_file);
 	log->debug("SLABCC log file: {}", log_file);
 
+	set_fft_planner(fft_planner);
+	set_poisson_solver(poisson_solver, poisson_bandwidth);
+	if (!fft_wisdom.empty()) {
+		if (import_fft_wisdom(fft_wisdom)) {
+			log->debug("FFTW wisdom has been loaded from {}", fft_wisdom);
+		}
+		else {
+			log->debug("No FFTW wisdom could be loaded from {}", fft_wisdom);
+		}
+	}
+
 	vector<pair<string, string>> calculation_results;
 
 	//promises for async read of CHGCAR and POTCAR files
 	vector<future<cube>> future_cells;
 
-	//promises for async file writing (can be replaced by a deque if the number of files increases)
-	vector<future<void>> future_files;
+	//background writers of the output files
+	output_queue output_files;
+
+	//each file is scanned once: its structure is parsed and its datasets are located
+	const VASP_grid_file CHGCAR_neutral_file(CHGCAR_neutral, grid_cache, "CHGCAR");
+	const VASP_grid_file CHGCAR_charged_file(CHGCAR_charged, grid_cache, "CHGCAR");
+	const VASP_grid_file LOCPOT_neutral_file(LOCPOT_neutral, grid_cache, "LOCPOT");
+	const VASP_grid_file LOCPOT_charged_file(LOCPOT_charged, grid_cache, "LOCPOT");
 
-	future_cells.push_back(async(launch::async, read_VASP_grid_data, CHGCAR_neutral));
-	future_cells.push_back(async(launch::async, read_VASP_grid_data, CHGCAR_charged));
-	future_cells.push_back(async(launch::async, read_VASP_grid_data, LOCPOT_neutral));
-	future_cells.push_back(async(launch::async, read_VASP_grid_data, LOCPOT_charged));
+	check_slabcc_compatiblity(CHGCAR_neutral_file, CHGCAR_charged_file, LOCPOT_neutral_file, LOCPOT_charged_file);
 
-	supercell Neutral_supercell(CHGCAR_neutral);
-	supercell Charged_supercell(CHGCAR_charged);
+	//the neutral and the charged grid data are only needed for their planar averages
+	//otherwise, only their differences are read from the files
+	const bool load_input_grids = is_active(verbosity::write_planarAvg_file) && !output_diffs_only;
 
-	Neutral_supercell.charge = future_cells.at(0).get();
-	Charged_supercell.charge = future_cells.at(1).get();
-	Neutral_supercell.potential = future_cells.at(2).get();
-	Charged_supercell.potential = future_cells.at(3).get();
+	//the defect files are written before the normalization
+	const bool write_defect_files = is_active(verbosity::write_defect_file) || output_diffs_only;
 
-	check_slabcc_compatiblity(Neutral_supercell, Charged_supercell);
+	if (load_input_grids) {
+		for (const auto grid_file : { &CHGCAR_neutral_file, &CHGCAR_charged_file, &LOCPOT_neutral_file, &LOCPOT_charged_file }) {
+			future_cells.push_back(async(launch::async, [grid_file] { return grid_file->load_dataset(0); }));
+		}
+	}
+
+	supercell Neutral_supercell = CHGCAR_neutral_file.structure;
+	supercell Charged_supercell = CHGCAR_charged_file.structure;
+
+	if (load_input_grids) {
+		Neutral_supercell.charge = future_cells.at(0).get();
+		Charged_supercell.charge = future_cells.at(1).get();
+		Neutral_supercell.potential = future_cells.at(2).get();
+		Charged_supercell.potential = future_cells.at(3).get();
+	}
 
 	//cell vectors of the CHGCAR and LOCPOT files (bohr)
 	const mat33 input_cell_vectors = abs(Neutral_supercell.cell_vectors) * Neutral_supercell.scaling * ang_to_bohr;
-	const urowvec3 input_grid_size = SizeVec(Neutral_supercell.charge);
+	const urowvec3 input_grid_size = CHGCAR_neutral_file.datasets.front().grid;
 	model.init_supercell(input_cell_vectors, input_grid_size);
 
 	const rowvec3 relative_shift = 0.5 - slabcenter;
@@ -125,25 +161,46 @@ int main(int argc, char *argv[]){
 	log->trace("Shift to center done!");
 
 	supercell Defect_supercell = Neutral_supercell;
-	Defect_supercell.potential = Charged_supercell.potential - Neutral_supercell.potential;
-	Defect_supercell.charge = Charged_supercell.charge - Neutral_supercell.charge;
+	const bool normalize_on_read = !load_input_grids && !write_defect_files;
+	if (load_input_grids) {
+		Defect_supercell.potential = Charged_supercell.potential - Neutral_supercell.potential;
+		Defect_supercell.charge = Charged_supercell.charge - Neutral_supercell.charge;
+	}
+	else {
+		//the differences are written directly to their shifted positions while reading the files
+		const rowvec3 grid_shift = output_diffs_only ? rowvec3(fill::zeros) : model.rounded_relative_shift;
+		const double charge_scale = normalize_on_read ? -1.0 / model.cell_volume : 1.0;
+		const double potential_scale = normalize_on_read ? -1.0 : 1.0;
+		auto future_charge = async(launch::async, read_VASP_grid_difference, cref(CHGCAR_charged_file), cref(CHGCAR_neutral_file), grid_shift, charge_scale);
+		Defect_supercell.potential = read_VASP_grid_difference(LOCPOT_charged_file, LOCPOT_neutral_file, grid_shift, potential_scale);
+		Defect_supercell.charge = future_charge.get();
+	}
 
-	if (is_active(verbosity::write_defect_file) || output_diffs_only) {
-		future_files.push_back(async(launch::async, &supercell::write_LOCPOT, Defect_supercell, "slabcc_D.LOCPOT"));
-		future_files.push_back(async(launch::async, &supercell::write_CHGCAR, Defect_supercell, "slabcc_D.CHGCAR"));
+	if (write_defect_files) {
+		//the Defect_supercell is normalized below, so the files are written from a snapshot of it
+		const auto Defect_snapshot = make_shared<const supercell>(Defect_supercell);
+		if (output_hdf5) {
+			output_files.push(Defect_snapshot, &supercell::write_HDF5, "slabcc_D.h5");
+		}
+		else {
+			output_files.push(Defect_snapshot, &supercell::write_LOCPOT, "slabcc_D.LOCPOT");
+			output_files.push(Defect_snapshot, &supercell::write_CHGCAR, "slabcc_D.CHGCAR");
+		}
 	}
 
 	//normalize the charges and potentials
-	Neutral_supercell.charge *= -1.0 / model.cell_volume;
-	Charged_supercell.charge *= -1.0 / model.cell_volume;
-	Defect_supercell.charge *= -1.0 / model.cell_volume;
-	Defect_supercell.potential *= -1.0;
+	if (!normalize_on_read) {
+		Neutral_supercell.charge *= -1.0 / model.cell_volume;
+		Charged_supercell.charge *= -1.0 / model.cell_volume;
+		Defect_supercell.charge *= -1.0 / model.cell_volume;
+		Defect_supercell.potential *= -1.0;
+	}
 	model.POT_target_on_input_grid = Defect_supercell.potential;
 
 	if (output_diffs_only) {
 		log->debug("Only the extra charge and the potential difference calculation have been requested!");
 		write_planar_avg(Defect_supercell.potential, Defect_supercell.charge * model.voxel_vol, "D", model.cell_vectors_lengths);
-		for (auto& promise : future_files) { promise.get(); }
+		output_files.wait();
 		finalize_loggers();
 		exit(0);
 	}
@@ -233,29 +290,42 @@ int main(int argc, char *argv[]){
 	vector<double> gradients = {};
 	model.potential_RMSE = potential_error(get<0>(local_param), gradients, &model);
 	model.check_V_error();
+	if (poisson_solver == "banded") {
+		const double truncation_error = dielectric_band_truncation_error(model.dielectric_profiles, poisson_bandwidth);
+		log->debug("Relative truncation error of the dielectric profiles spectrum (bandwidth {}): {}", poisson_bandwidth, truncation_error);
+		if (truncation_error > 1e-4) {
+			log->warn("The dielectric profiles are not well represented with the poisson_bandwidth = {}. A larger bandwidth should be used!", poisson_bandwidth);
+		}
+	}
 
 	log->debug("Cell dimensions (bohr): " + to_string(model.cell_vectors_lengths));
 	log->debug("Volume (bohr^3): {}", model.cell_volume);
 
 
 	if (is_active(verbosity::write_defect_file)) {
-		supercell Model_supercell = Neutral_supercell;
+		//the grids of the Neutral_supercell are not needed anymore and are replaced by the model's
+		const auto Model_supercell = make_shared<supercell>(move(Neutral_supercell));
 		//charge is normalized to the VASP CHGCAR convention (rho * Vol)
 		//Also, positive value for the electron charge! (the probability of finding an electron)
-		Model_supercell.charge = -real(model.CHG) * model.voxel_vol * model.CHG.n_elem;
-		Model_supercell.potential = -real(model.POT) * Hartree_to_eV;
-		future_files.push_back(async(launch::async, &supercell::write_CHGCAR, Model_supercell, "slabcc_M.CHGCAR"));
-		future_files.push_back(async(launch::async, &supercell::write_LOCPOT, Model_supercell, "slabcc_M.LOCPOT"));
+		Model_supercell->charge = -model.CHG * model.voxel_vol * model.CHG.n_elem;
+		Model_supercell->potential = -model.POT * Hartree_to_eV;
+		if (output_hdf5) {
+			output_files.push(Model_supercell, &supercell::write_HDF5, "slabcc_M.h5");
+		}
+		else {
+			output_files.push(Model_supercell, &supercell::write_CHGCAR, "slabcc_M.CHGCAR");
+			output_files.push(Model_supercell, &supercell::write_LOCPOT, "slabcc_M.LOCPOT");
+		}
 	}
 
 	if (is_active(verbosity::write_dielectric_file)) {
 		model.dielectric_profiles.save("slabcc_DIEL.dat", raw_ascii);
 	}
 	if (is_active(verbosity::write_planarAvg_file)) {
-		write_planar_avg(real(model.POT) * Hartree_to_eV, real(model.CHG) * model.voxel_vol, "M", model.cell_vectors_lengths);
+		write_planar_avg(model.POT * Hartree_to_eV, model.CHG * model.voxel_vol, "M", model.cell_vectors_lengths);
 	}
 	else if (is_active(verbosity::write_normal_planarAvg)) {
-		write_planar_avg(real(model.POT) * Hartree_to_eV, real(model.CHG) * model.voxel_vol, "M", model.cell_vectors_lengths, model.normal_direction);
+		write_planar_avg(model.POT * Hartree_to_eV, model.CHG * model.voxel_vol, "M", model.cell_vectors_lengths, model.normal_direction);
 	}
 	
 	model.verify_CHG(Defect_supercell.charge);
@@ -263,7 +333,7 @@ int main(int argc, char *argv[]){
 	//add jellium to the charge (Because the V is normalized, it is not needed in solving the Poisson eq. but it is needed in the energy calculations)
 	model.CHG -= model.total_charge / model.cell_volume;
 
-	const uword farthest_element_index = model.total_charge < 0 ? real(model.POT).index_max() : real(model.POT).index_min();
+	const uword farthest_element_index = model.total_charge < 0 ? model.POT.index_max() : model.POT.index_min();
 
 	const auto dV = model.POT_diff(farthest_element_index);
 	log->info("Potential alignment (dV=): {}", ::to_string(dV));
@@ -281,7 +351,7 @@ int main(int argc, char *argv[]){
 
 	log->debug("Calculation grid point for the potential alignment term: {}", to_string(ind2sub(as_size(model.cell_grid), farthest_element_index)));
 
-	const double EperModel0 = 0.5 * accu(real(model.POT) % real(model.CHG)) * model.voxel_vol * Hartree_to_eV;
+	const double EperModel0 = 0.5 * accu(model.POT % model.CHG) * model.voxel_vol * Hartree_to_eV;
 	log->info("E_periodic of the model charge: {}", ::to_string(EperModel0));
 	calculation_results.emplace_back("E_periodic of the model charge", ::to_string(EperModel0));
 
@@ -394,6 +464,9 @@ int main(int argc, char *argv[]){
 
 	log->info("Energy correction for the model charge (E_iso-E_per-q*dV=): {}", ::to_string(E_correction) );
 	calculation_results.emplace_back("Energy correction for the model charge (E_iso-E_per-q*dV)", ::to_string(E_correction));
+	if (!fft_wisdom.empty() && !export_fft_wisdom(fft_wisdom)) {
+		log->warn("FFTW wisdom could not be written to {}", fft_wisdom);
+	}
 	log->flush();
 	
 	finalize_loggers();
@@ -402,7 +475,7 @@ int main(int argc, char *argv[]){
 	output_log->flush();
 	
 	//making sure all the files are written
-	for (auto &promise : future_files) { promise.get(); }
+	output_files.wait();
 
 	log->trace("Calculations successfully ended!");
 	return 0;
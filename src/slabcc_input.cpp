@@ -75,6 +75,53 @@ void input_data::verify() const {
 	}
 
 
+#ifndef FFTW_SINGLE
+	if (optimize_single_precision) {
+		log->warn("Support for the single precision FFTs is not enabled in this build (-DFFTW_FLOAT)!");
+		optimize_single_precision = false;
+		log->warn("The optimization will be done in double precision!");
+	}
+#endif
+
+	if ((fft_planner != "estimate") && (fft_planner != "measure") && (fft_planner != "patient")) {
+		log->debug("FFT planner: {}", fft_planner);
+		log->warn("Unsupported FFT planner has been selected!");
+		fft_planner = "estimate";
+		log->warn("{} will be used instead!", fft_planner);
+	}
+
+	if ((interpolation != "spline") && (interpolation != "fourier")) {
+		log->debug("Interpolation method: {}", interpolation);
+		log->warn("Unsupported interpolation method has been selected!");
+		interpolation = "spline";
+		log->warn("{} will be used instead!", interpolation);
+	}
+
+	if ((poisson_solver != "direct") && (poisson_solver != "eigen") && (poisson_solver != "banded") && (poisson_solver != "iterative")
+		&& (poisson_solver != "multigrid")) {
+		log->debug("Poisson solver: {}", poisson_solver);
+		log->warn("Unsupported Poisson solver has been selected!");
+		poisson_solver = "direct";
+		log->warn("{} will be used instead!", poisson_solver);
+	}
+
+	if ((poisson_solver == "banded") && (poisson_bandwidth < 1)) {
+		log->debug("Requested Poisson solver bandwidth: {}", poisson_bandwidth);
+		log->warn("The bandwidth of the banded Poisson solver must be a positive integer!");
+		poisson_bandwidth = 32;
+		log->warn("poisson_bandwidth = {} will be used instead!", poisson_bandwidth);
+	}
+
+	if (poisson_solver == "eigen") {
+		uvec inplane_axes = { 0, 1, 2 };
+		inplane_axes.shed_row(normal_direction);
+		if ((diel_in(inplane_axes(0)) != diel_in(inplane_axes(1))) || (diel_out(inplane_axes(0)) != diel_out(inplane_axes(1)))) {
+			log->warn("The eigen Poisson solver needs the same in-plane dielectric tensor elements!");
+			poisson_solver = "direct";
+			log->warn("{} will be used instead!", poisson_solver);
+		}
+	}
+
 	if (charge_position.n_cols != 3) {
 		log->debug("Number of the parameters defined for the position of a charge: {}", charge_position.n_cols);
 		log->critical("Incorrect definition of charge positions!");
@@ -260,6 +307,7 @@ void input_data::parse(const string& input_file) const {
 	charge_position = reader.GetMat("charge_position", {});
 	charge_fraction = reader.GetVec("charge_fraction", rowvec(charge_position.n_rows, fill::ones) / charge_position.n_rows);
 	trivariate = reader.GetBoolean("charge_trivariate", false);
+	charge_reciprocal = reader.GetBoolean("charge_reciprocal", false);
 	charge_rotations = reader.GetMat("charge_rotation", zeros<mat>(arma::size(charge_position)));
 	charge_sigma = reader.GetMat("charge_sigma", ones<mat>(arma::size(charge_position)));
 	slabcenter = reader.GetVec("slab_center", { 0.5, 0.5, 0.5 });
@@ -277,6 +325,7 @@ void input_data::parse(const string& input_file) const {
 	model_2D = reader.GetBoolean("2d_model", false);
 	opt_algo = reader.GetStr("optimize_algorithm", "BOBYQA");
 	opt_tol = reader.GetReal("optimize_tolerance", 0.01);
+	optimize_single_precision = reader.GetBoolean("optimize_single_precision", false);
 	max_eval = reader.GetInteger("optimize_maxsteps", 0);
 	max_time = reader.GetInteger("optimize_maxtime", 0);
 	opt_grid_x = reader.GetReal("optimize_grid_x", 0.8);
@@ -284,6 +333,13 @@ void input_data::parse(const string& input_file) const {
 	extrapol_grid_x = reader.GetReal("extrapolate_grid_x", 1);
 	extrapol_steps_num = reader.GetInteger("extrapolate_steps_number", model_2D ? 10 : 4);
 	extrapol_steps_size = reader.GetReal("extrapolate_steps_size", model_2D ? 1 : 0.5);
+	grid_cache = reader.GetBoolean("grid_cache", false);
+	output_hdf5 = reader.GetBoolean("output_hdf5", false);
+	fft_planner = reader.GetStr("fft_planner", "estimate");
+	fft_wisdom = reader.GetStr("fft_wisdom", "");
+	interpolation = reader.GetStr("interpolation", "spline");
+	poisson_solver = reader.GetStr("poisson_solver", "direct");
+	poisson_bandwidth = reader.GetInteger("poisson_bandwidth", 32);
 
 	reader.dump_parsed();
 
@@ -17,6 +17,9 @@ struct input_data {
 	double &opt_grid_x, &extrapol_grid_x;
 	int &max_eval, &max_time, &extrapol_steps_num;
 	double &extrapol_steps_size;
+	bool &grid_cache, &output_hdf5, &charge_reciprocal, &optimize_single_precision;
+	string &fft_planner, &fft_wisdom, &interpolation, &poisson_solver;
+	int &poisson_bandwidth;
 
 	//read the input variables from the input_file
 	void parse(const string& input_file) const;
@@ -3,38 +3,118 @@
 // See the accompanying LICENSE.txt file for terms.
 
 #include "slabcc_math.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-cube interp3(const rowvec& x, const rowvec& y, const rowvec& z, const cube& v, const rowvec& xi, const rowvec& yi, const rowvec& zi) {
-	cube v_x = zeros(xi.n_elem, y.n_elem, z.n_elem);
-	cube v_xy = zeros(xi.n_elem, yi.n_elem, z.n_elem);
-	cube v_xyz = zeros(xi.n_elem, yi.n_elem, zi.n_elem);
+//MKL's FFTW interface includes the threaded FFTs, otherwise the fftw3_omp (or fftw3_threads) library is needed
+#if defined(FFTW_OMP) || defined(MKL)
+#define FFTW_THREADS
+#endif
 
-	vec vec_i = zeros<vec>(x.n_elem);
+namespace {
+	//natural cubic spline (same boundary conditions and extrapolation as the Spline class) along one axis for a batch of lines
+	//the tridiagonal system depends only on the knots and is factored once, the segment and the offset of every target point are also precomputed
+	struct spline_resampler {
+		spline_resampler(const rowvec& x, const rowvec& xi) : n(x.n_elem - 1), h(x.n_elem), l(x.n_elem, 1.0), u(x.n_elem, 0.0), segment(xi.n_elem), offset(xi.n_elem) {
+			if (x.n_elem < 3) {
+				n = 0;
+				return;
+			}
+			h[0] = x(1) - x(0);
+			for (uword i = 1; i < n; ++i) {
+				h[i] = x(i + 1) - x(i);
+				l[i] = 2 * (x(i + 1) - x(i - 1)) - h[i - 1] * u[i - 1];
+				u[i] = h[i] / l[i];
+			}
+			for (uword p = 0; p < xi.n_elem; ++p) {
+				//segment search as in Spline::interpolate
+				const double* it = std::lower_bound(x.memptr(), x.memptr() + n, xi(p));
+				segment[p] = it == x.memptr() ? 0 : (it - x.memptr()) - 1;
+				offset[p] = xi(p) - x(segment[p]);
+			}
+		}
+
+		//value i of the line m is at [i * stride + m] in both the input and the output, m < lines
+		void resample(const double* in, double* out, const uword stride, const uword lines) const {
+			if (n == 0) {
+				for (uword p = 0; p < segment.size(); ++p) {
+					std::fill(out + p * stride, out + p * stride + lines, 0.0);
+				}
+				return;
+			}
+
+			vector<double> c((n + 1) * lines, 0.0);
+			//forward substitution (z is stored in c)
+			for (uword i = 1; i < n; ++i) {
+				const double* y0 = in + (i - 1) * stride;
+				const double* y1 = in + i * stride;
+				const double* y2 = in + (i + 1) * stride;
+				const double* z0 = &c[(i - 1) * lines];
+				double* z1 = &c[i * lines];
+				for (uword m = 0; m < lines; ++m) {
+					const double a = (3 / h[i]) * (y2[m] - y1[m]) - (3 / h[i - 1]) * (y1[m] - y0[m]);
+					z1[m] = (a - h[i - 1] * z0[m]) / l[i];
+				}
+			}
+			//back substitution
+			for (sword j = n - 1; j >= 0; --j) {
+				double* c0 = &c[j * lines];
+				const double* c1 = &c[(j + 1) * lines];
+				for (uword m = 0; m < lines; ++m) {
+					c0[m] -= u[j] * c1[m];
+				}
+			}
 
-	for (uword i = 0; i < y.n_elem; ++i) {
-		for (uword j = 0; j < z.n_elem; ++j) {
-			vec_i = vectorise(v(span(), span(i), span(j)));
-			Spline<double> sp(x, vec_i);
-			v_x(span(), span(i), span(j)) = sp.interpolate(xi);
+			for (uword p = 0; p < segment.size(); ++p) {
+				const uword j = segment[p];
+				const double t = offset[p];
+				const double* y0 = in + j * stride;
+				const double* y1 = in + (j + 1) * stride;
+				const double* c0 = &c[j * lines];
+				const double* c1 = &c[(j + 1) * lines];
+				double* v = out + p * stride;
+				for (uword m = 0; m < lines; ++m) {
+					const double b = (y1[m] - y0[m]) / h[j] - (h[j] * (c1[m] + 2 * c0[m])) / 3;
+					const double d = (c1[m] - c0[m]) / (3 * h[j]);
+					v[m] = y0[m] + b * t + c0[m] * (t * t) + d * (t * t * t);
+				}
+			}
 		}
+
+		uword n;
+		vector<double> h, l, u;
+		vector<uword> segment;
+		vector<double> offset;
+	};
+}
+
+cube interp3(const rowvec& x, const rowvec& y, const rowvec& z, const cube& v, const rowvec& xi, const rowvec& yi, const rowvec& zi) {
+	const spline_resampler sx(x, xi), sy(y, yi), sz(z, zi);
+	cube v_x(xi.n_elem, y.n_elem, z.n_elem);
+	cube v_xy(xi.n_elem, yi.n_elem, z.n_elem);
+	cube v_xyz(xi.n_elem, yi.n_elem, zi.n_elem);
+
+	//the lines along x are contiguous, each slice is transposed to resample all its lines together
+#pragma omp parallel for
+	for (uword k = 0; k < z.n_elem; ++k) {
+		const mat v_t = v.slice(k).t();
+		mat v_x_t(y.n_elem, xi.n_elem);
+		sx.resample(v_t.memptr(), v_x_t.memptr(), y.n_elem, y.n_elem);
+		v_x.slice(k) = v_x_t.t();
 	}
 
-	vec_i.set_size(y.n_elem);
-	for (uword i = 0; i < xi.n_elem; ++i) {
-		for (uword j = 0; j < z.n_elem; ++j) {
-			vec_i = vectorise(v_x(span(i), span(), span(j)));
-			Spline<double> sp(y, vec_i);
-			v_xy(span(i), span(), span(j)) = sp.interpolate(yi);
-		}
+#pragma omp parallel for
+	for (uword k = 0; k < z.n_elem; ++k) {
+		sy.resample(v_x.slice_memptr(k), v_xy.slice_memptr(k), xi.n_elem, xi.n_elem);
 	}
 
-	vec_i.set_size(z.n_elem);
-	for (uword i = 0; i < xi.n_elem; ++i) {
-		for (uword j = 0; j < yi.n_elem; ++j) {
-			vec_i = vectorise(v_xy(span(i), span(j), span()));
-			Spline<double> sp(z, vec_i);
-			v_xyz(span(i), span(j), span()) = sp.interpolate(zi);
-		}
+	//lines along z are resampled in batches of contiguous columns
+	const uword lines = xi.n_elem * yi.n_elem;
+	const uword batch = 1024;
+#pragma omp parallel for
+	for (uword first = 0; first < lines; first += batch) {
+		sz.resample(v_xy.memptr() + first, v_xyz.memptr() + first, lines, std::min(batch, lines - first));
 	}
 	return v_xyz;
 }
@@ -67,45 +147,307 @@ tuple<cube, cube, cube> meshgrid(const rowvec& v1, const rowvec& v2, const rowve
 	return make_tuple(x2, y2, z2);
 }
 
-cube shift(cube cube_in, rowvec3 shifts) {
+cube shift(const cube& cube_in, rowvec3 shifts) {
 	if (cube_in.is_empty()) {
 		return {};
 	}
 
 	shifts = round(rowvec3(SizeVec(cube_in) % shifts));
-	for (uword i = 0; i < 3; ++i) {
-		cube_in = shift(cube_in, shifts(i), i);
+
+	return circshift(cube_in, static_cast<sword>(shifts(0)), static_cast<sword>(shifts(1)), static_cast<sword>(shifts(2)));
+}
+
+void add_outer_product(cube& A, const rowvec& x, const rowvec& y, const rowvec& z) {
+#pragma omp parallel for
+	for (uword k = 0; k < A.n_slices; ++k) {
+		for (uword j = 0; j < A.n_cols; ++j) {
+			const double yz = y(j) * z(k);
+			const double* xi = x.memptr();
+			double* col = A.slice_colptr(k, j);
+			for (uword i = 0; i < A.n_rows; ++i) {
+				col[i] += xi[i] * yz;
+			}
+		}
 	}
+}
+
+void add_gaussian(cube& A, const rowvec& x, const rowvec& y, const rowvec& z, const mat33& inv_covariance, const double scale) {
+	//the quadratic form is expanded along x: (a x^2 + b x + c) with b and c fixed for each column
+	//b and the yz term of c already include the factor 2 of the symmetric off-diagonal elements (e.g. bxy = A01 + A10)
+	const double a = inv_covariance(0, 0);
+	const double bxy = inv_covariance(0, 1) + inv_covariance(1, 0);
+	const double bxz = inv_covariance(0, 2) + inv_covariance(2, 0);
+	const double cyz = inv_covariance(1, 2) + inv_covariance(2, 1);
+	const rowvec ax2 = a * square(x);
+	const double* xi = x.memptr();
+	const double* ax2i = ax2.memptr();
 
-	return cube_in;
+#pragma omp parallel for
+	for (uword k = 0; k < A.n_slices; ++k) {
+		for (uword j = 0; j < A.n_cols; ++j) {
+			const double b = bxy * y(j) + bxz * z(k);
+			const double c = inv_covariance(1, 1) * y(j) * y(j) + inv_covariance(2, 2) * z(k) * z(k) + cyz * y(j) * z(k);
+			double* col = A.slice_colptr(k, j);
+#pragma omp simd
+			for (uword i = 0; i < A.n_rows; ++i) {
+				col[i] += scale * std::exp(-0.5 * (ax2i[i] + b * xi[i] + c));
+			}
+		}
+	}
 }
 
-vec planar_average(const uword& direction, const cube& cube_in) {
-	const uword dim_size = arma::size(cube_in)(direction);
-	vec average = vec(dim_size);
-	for (uword i = 0; i < dim_size; ++i) {
-		switch (direction) {
-		case 0:
-			average(i) = accu(cube_in(span(i), span(), span()));
-			break;
-		case 1:
-			average(i) = accu(cube_in(span(), span(i), span()));
-			break;
-		case 2:
-			average(i) = accu(cube_in(span(), span(), span(i)));
-			break;
+vector<array<vec, 3>> planar_sums(const vector<const cube*>& cubes_in) {
+	//partial sums of each slice are kept separately and added up in a fixed order at the end,
+	//so the results do not depend on the number of threads
+	vector<mat> x_partials, y_partials;
+	vector<uword> first_slice = { 0 };
+	for (const auto& cube_in : cubes_in) {
+		x_partials.emplace_back(cube_in->n_rows, cube_in->n_slices);
+		y_partials.emplace_back(cube_in->n_cols, cube_in->n_slices);
+		first_slice.push_back(first_slice.back() + cube_in->n_slices);
+	}
+
+#pragma omp parallel for schedule(static)
+	for (uword slice = 0; slice < first_slice.back(); ++slice) {
+		const uword c = upper_bound(first_slice.begin(), first_slice.end(), slice) - first_slice.begin() - 1;
+		const cube& cube_in = *cubes_in.at(c);
+		const uword k = slice - first_slice.at(c);
+		double* const x_sums = x_partials.at(c).colptr(k);
+		double* const y_sums = y_partials.at(c).colptr(k);
+		std::fill(x_sums, x_sums + cube_in.n_rows, 0.0);
+		for (uword j = 0; j < cube_in.n_cols; ++j) {
+			const double* const column = cube_in.slice_colptr(k, j);
+			double column_sum = 0;
+			for (uword i = 0; i < cube_in.n_rows; ++i) {
+				x_sums[i] += column[i];
+				column_sum += column[i];
+			}
+			y_sums[j] = column_sum;
 		}
 	}
-	return average;
+
+	vector<array<vec, 3>> sums;
+	for (uword c = 0; c < cubes_in.size(); ++c) {
+		sums.push_back({ sum(x_partials.at(c), 1), sum(y_partials.at(c), 1), sum(y_partials.at(c), 0).t() });
+	}
+	return sums;
+}
+
+namespace {
+	unsigned fft_planner_flag = FFTW_ESTIMATE;
+
+	enum class fft_kind { c2c, r2c, c2r };
+
+	//rank, kind, sign, dimensions, half axis, alignments of the input and the output, threads
+	using fft_plan_key = tuple<size_t, fft_kind, int, array<int, 3>, int, int, int, int>;
+	mutex fft_plans_mutex;
+
+	//FFTW functions of each precision: fftw_* (double) and fftwf_* (float)
+	template <typename T> struct fftw_api;
+
+	template <> struct fftw_api<double> {
+		using plan = fftw_plan;
+		using complex = fftw_complex;
+		static int alignment_of(double* p) { return fftw_alignment_of(p); }
+		static plan plan_dft(int rank, const int* n, complex* in, complex* out, int sign, unsigned flags) { return fftw_plan_dft(rank, n, in, out, sign, flags); }
+		static plan plan_r2c(int rank, const fftw_iodim* dims, double* in, complex* out, unsigned flags) { return fftw_plan_guru_dft_r2c(rank, dims, 0, nullptr, in, out, flags); }
+		static plan plan_c2r(int rank, const fftw_iodim* dims, complex* in, double* out, unsigned flags) { return fftw_plan_guru_dft_c2r(rank, dims, 0, nullptr, in, out, flags); }
+		static void execute_dft(const plan p, complex* in, complex* out) { fftw_execute_dft(p, in, out); }
+		static void execute_r2c(const plan p, double* in, complex* out) { fftw_execute_dft_r2c(p, in, out); }
+		static void execute_c2r(const plan p, complex* in, double* out) { fftw_execute_dft_c2r(p, in, out); }
+		static void destroy_plan(plan p) { fftw_destroy_plan(p); }
+#ifdef FFTW_THREADS
+		static int init_threads() { return fftw_init_threads(); }
+		static void plan_with_nthreads(int threads) { fftw_plan_with_nthreads(threads); }
+#endif
+	};
+
+#ifdef FFTW_SINGLE
+	template <> struct fftw_api<float> {
+		using plan = fftwf_plan;
+		using complex = fftwf_complex;
+		static int alignment_of(float* p) { return fftwf_alignment_of(p); }
+		static plan plan_dft(int rank, const int* n, complex* in, complex* out, int sign, unsigned flags) { return fftwf_plan_dft(rank, n, in, out, sign, flags); }
+		static plan plan_r2c(int rank, const fftwf_iodim* dims, float* in, complex* out, unsigned flags) { return fftwf_plan_guru_dft_r2c(rank, dims, 0, nullptr, in, out, flags); }
+		static plan plan_c2r(int rank, const fftwf_iodim* dims, complex* in, float* out, unsigned flags) { return fftwf_plan_guru_dft_c2r(rank, dims, 0, nullptr, in, out, flags); }
+		static void execute_dft(const plan p, complex* in, complex* out) { fftwf_execute_dft(p, in, out); }
+		static void execute_r2c(const plan p, float* in, complex* out) { fftwf_execute_dft_r2c(p, in, out); }
+		static void execute_c2r(const plan p, complex* in, float* out) { fftwf_execute_dft_c2r(p, in, out); }
+		static void destroy_plan(plan p) { fftwf_destroy_plan(p); }
+#ifdef FFTW_THREADS
+		static int init_threads() { return fftwf_init_threads(); }
+		static void plan_with_nthreads(int threads) { fftwf_plan_with_nthreads(threads); }
+#endif
+	};
+#endif
+
+	//cached plans of each precision (guarded by fft_plans_mutex)
+	template <typename T>
+	map<fft_plan_key, typename fftw_api<T>::plan>& fft_plans() {
+		static map<fft_plan_key, typename fftw_api<T>::plan> plans;
+		return plans;
+	}
+
+	template <typename T>
+	void destroy_fft_plans() {
+		for (auto& plan : fft_plans<T>()) {
+			fftw_api<T>::destroy_plan(plan.second);
+		}
+		fft_plans<T>().clear();
+	}
+
+	//returns the cached plan for the transformation or plans it once on scratch arrays
+	//T: precision of the data (double or float)
+	//dims: column-major (Armadillo) sizes of the data, e.g. {n_rows, n_cols, n_slices}. For r2c/c2r: sizes of the real data
+	//half_axis (r2c/c2r): the axis along which only the first n/2+1 elements of the spectrum are stored
+	//the plan can be executed on any arrays with the same alignment as in and out by the new-array execute functions
+	template <typename T>
+	typename fftw_api<T>::plan cached_plan(const vector<int>& dims, const fft_kind kind, const int sign, const int half_axis, const void* in, const void* out) {
+		using api = fftw_api<T>;
+		using complex = typename api::complex;
+		const int in_alignment = api::alignment_of(reinterpret_cast<T*>(const_cast<void*>(in)));
+		const int out_alignment = api::alignment_of(reinterpret_cast<T*>(const_cast<void*>(out)));
+		array<int, 3> key_dims = { 0, 0, 0 };
+		copy(dims.begin(), dims.end(), key_dims.begin());
+
+		//the 3D FFTs use the same number of threads as the OpenMP loops. The 1D FFTs are too small for threading.
+		int threads = 1;
+#if defined(FFTW_THREADS) && defined(_OPENMP)
+		if (dims.size() > 1) {
+			threads = omp_get_max_threads();
+		}
+#endif
+		const fft_plan_key key{ dims.size(), kind, sign, key_dims, half_axis, in_alignment, out_alignment, threads };
+
+		lock_guard<mutex> lock(fft_plans_mutex);
+		auto& plans = fft_plans<T>();
+		const auto cached = plans.find(key);
+		if (cached != plans.end()) {
+			return cached->second;
+		}
+
+#ifdef FFTW_THREADS
+		static const bool threads_initialized = (api::init_threads() != 0);
+		if (threads_initialized) {
+			api::plan_with_nthreads(threads);
+		}
+#endif
+
+		vector<int> half_dims = dims;
+		if (kind != fft_kind::c2c) {
+			half_dims.at(half_axis) = dims.at(half_axis) / 2 + 1;
+		}
+		size_t real_elements = 1;
+		size_t half_elements = 1;
+		vector<int> real_strides, half_strides;
+		for (size_t i = 0; i < dims.size(); ++i) {
+			real_strides.push_back(static_cast<int>(real_elements));
+			half_strides.push_back(static_cast<int>(half_elements));
+			real_elements *= dims.at(i);
+			half_elements *= half_dims.at(i);
+		}
+
+		//the planner (except with FFTW_ESTIMATE) overwrites the arrays
+		const size_t in_bytes = (kind == fft_kind::r2c) ? real_elements * sizeof(T) : half_elements * sizeof(complex);
+		const size_t out_bytes = (kind == fft_kind::c2r) ? real_elements * sizeof(T) : half_elements * sizeof(complex);
+		char* const in_scratch = static_cast<char*>(fftw_malloc(in_bytes + 64));
+		char* const out_scratch = static_cast<char*>(fftw_malloc(out_bytes + 64));
+		T* const in_data = reinterpret_cast<T*>(in_scratch + in_alignment);
+		T* const out_data = reinterpret_cast<T*>(out_scratch + out_alignment);
+
+		typename api::plan plan;
+		if (kind == fft_kind::c2c) {
+			const vector<int> row_major_dims(dims.rbegin(), dims.rend());
+			plan = api::plan_dft(static_cast<int>(dims.size()), row_major_dims.data(), reinterpret_cast<complex*>(in_data), reinterpret_cast<complex*>(out_data), sign, fft_planner_flag);
+		}
+		else {
+			//FFTW halves the last dimension in its list
+			vector<fftw_iodim> io_dims;
+			for (int i = static_cast<int>(dims.size()) - 1; i >= 0; --i) {
+				if (i != half_axis) {
+					io_dims.push_back({ dims.at(i), 0, 0 });
+					io_dims.back().is = (kind == fft_kind::r2c) ? real_strides.at(i) : half_strides.at(i);
+					io_dims.back().os = (kind == fft_kind::r2c) ? half_strides.at(i) : real_strides.at(i);
+				}
+			}
+			io_dims.push_back({ dims.at(half_axis), 0, 0 });
+			io_dims.back().is = (kind == fft_kind::r2c) ? real_strides.at(half_axis) : half_strides.at(half_axis);
+			io_dims.back().os = (kind == fft_kind::r2c) ? half_strides.at(half_axis) : real_strides.at(half_axis);
+
+			if (kind == fft_kind::r2c) {
+				plan = api::plan_r2c(static_cast<int>(io_dims.size()), io_dims.data(), in_data, reinterpret_cast<complex*>(out_data), fft_planner_flag);
+			}
+			else {
+				plan = api::plan_c2r(static_cast<int>(io_dims.size()), io_dims.data(), reinterpret_cast<complex*>(in_data), out_data, fft_planner_flag);
+			}
+		}
+		fftw_free(in_scratch);
+		fftw_free(out_scratch);
+
+		plans.emplace(key, plan);
+		return plan;
+	}
+
+	//real to complex (half spectrum) FFT
+	template <typename T>
+	void execute_fft(const vector<int>& dims, const int half_axis, T* in, complex<T>* out) {
+		using api = fftw_api<T>;
+		api::execute_r2c(cached_plan<T>(dims, fft_kind::r2c, FFTW_FORWARD, half_axis, in, out), in, reinterpret_cast<typename api::complex*>(out));
+	}
+
+	//complex (half spectrum) to real FFT. The input is overwritten!
+	template <typename T>
+	void execute_fft(const vector<int>& dims, const int half_axis, complex<T>* in, T* out) {
+		using api = fftw_api<T>;
+		api::execute_c2r(cached_plan<T>(dims, fft_kind::c2r, FFTW_BACKWARD, half_axis, in, out), reinterpret_cast<typename api::complex*>(in), out);
+	}
+
+	//complex FFT
+	template <typename T>
+	void execute_fft(const vector<int>& dims, complex<T>* in, complex<T>* out, const int sign) {
+		using api = fftw_api<T>;
+		api::execute_dft(cached_plan<T>(dims, fft_kind::c2c, sign, -1, in, out), reinterpret_cast<typename api::complex*>(in), reinterpret_cast<typename api::complex*>(out));
+	}
+
+	vector<int> fft_dims(const SizeCube& size) {
+		return { static_cast<int>(size.n_rows), static_cast<int>(size.n_cols), static_cast<int>(size.n_slices) };
+	}
+}
+
+void set_fft_planner(const string& planner) {
+	lock_guard<mutex> lock(fft_plans_mutex);
+	const unsigned flag = (planner == "patient") ? FFTW_PATIENT : (planner == "measure") ? FFTW_MEASURE : FFTW_ESTIMATE;
+	if (flag != fft_planner_flag) {
+		destroy_fft_plans<double>();
+#ifdef FFTW_SINGLE
+		destroy_fft_plans<float>();
+#endif
+		fft_planner_flag = flag;
+	}
+}
+
+bool import_fft_wisdom(const string& file_name) {
+	lock_guard<mutex> lock(fft_plans_mutex);
+	bool imported = (fftw_import_wisdom_from_filename(file_name.c_str()) != 0);
+#ifdef FFTW_SINGLE
+	imported = (fftwf_import_wisdom_from_filename((file_name + ".float").c_str()) != 0) && imported;
+#endif
+	return imported;
+}
+
+bool export_fft_wisdom(const string& file_name) {
+	lock_guard<mutex> lock(fft_plans_mutex);
+	bool exported = (fftw_export_wisdom_to_filename(file_name.c_str()) != 0);
+#ifdef FFTW_SINGLE
+	exported = (fftwf_export_wisdom_to_filename((file_name + ".float").c_str()) != 0) && exported;
+#endif
+	return exported;
 }
 
 cx_vec fft(vec X)
 {
-	//TODO: should come up with a better solution than reinterpret_cast
 	cx_vec out(X.n_elem);
-	fftw_plan plan = fftw_plan_dft_r2c_1d(X.n_elem, X.memptr(), reinterpret_cast<fftw_complex*>(out.memptr()), FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	execute_fft({ static_cast<int>(X.n_elem) }, 0, X.memptr(), out.memptr());
 
 	for (uword i = out.n_elem / 2 + 1; i < out.n_elem; ++i)
 		out(i) = conj(out(X.n_rows - i));
@@ -116,19 +458,14 @@ cx_vec fft(vec X)
 cx_vec fft(cx_vec X)
 {
 	cx_vec out(X.n_elem);
-	fftw_plan plan = fftw_plan_dft_1d(X.n_elem, reinterpret_cast<fftw_complex*>(X.memptr()), reinterpret_cast<fftw_complex*>(out.memptr()), FFTW_FORWARD, FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	execute_fft({ static_cast<int>(X.n_elem) }, X.memptr(), out.memptr(), FFTW_FORWARD);
 
 	return out;
 }
 
 cx_cube fft(cube X)
 {
-	cx_cube out(X.n_rows / 2 + 1, X.n_cols, X.n_slices);
-	fftw_plan plan = fftw_plan_dft_r2c_3d(X.n_slices, X.n_cols, X.n_rows, X.memptr(), reinterpret_cast<fftw_complex*>(out.memptr()), FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	cx_cube out = fft_r2c(X);
 	out.resize(X.n_rows, X.n_cols, X.n_slices);
 
 	for (uword i = X.n_rows / 2 + 1; i < X.n_rows; ++i) {
@@ -152,19 +489,23 @@ cx_cube fft(cube X)
 cx_cube fft(cx_cube X)
 {
 	cx_cube fft(X.n_rows, X.n_cols, X.n_slices);
-	fftw_plan plan = fftw_plan_dft_3d(X.n_slices, X.n_cols, X.n_rows, reinterpret_cast<fftw_complex*>(X.memptr()), reinterpret_cast<fftw_complex*>(fft.memptr()), FFTW_FORWARD, FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	execute_fft(fft_dims(arma::size(X)), X.memptr(), fft.memptr(), FFTW_FORWARD);
 
 	return fft;
 }
 
+cx_cube fft_r2c(cube X, const uword half_axis)
+{
+	cx_cube out((half_axis == 0) ? X.n_rows / 2 + 1 : X.n_rows, (half_axis == 1) ? X.n_cols / 2 + 1 : X.n_cols, X.n_slices);
+	execute_fft(fft_dims(arma::size(X)), static_cast<int>(half_axis), X.memptr(), out.memptr());
+
+	return out;
+}
+
 cx_vec ifft(cx_vec X)
 {
 	cx_vec out(X.n_elem);
-	fftw_plan plan = fftw_plan_dft_1d(X.n_elem, reinterpret_cast<fftw_complex*>(X.memptr()), reinterpret_cast<fftw_complex*>(out.memptr()), FFTW_BACKWARD, FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	execute_fft({ static_cast<int>(X.n_elem) }, X.memptr(), out.memptr(), FFTW_BACKWARD);
 
 	return out / out.n_elem;
 }
@@ -172,13 +513,91 @@ cx_vec ifft(cx_vec X)
 cx_cube ifft(cx_cube X)
 {
 	cx_cube ifft(X.n_rows, X.n_cols, X.n_slices);
-	fftw_plan plan = fftw_plan_dft_3d(X.n_slices, X.n_cols, X.n_rows, reinterpret_cast<fftw_complex*>(X.memptr()), reinterpret_cast<fftw_complex*>(ifft.memptr()), FFTW_BACKWARD, FFTW_ESTIMATE);
-	fftw_execute(plan);
-	fftw_destroy_plan(plan);
+	execute_fft(fft_dims(arma::size(X)), X.memptr(), ifft.memptr(), FFTW_BACKWARD);
 
 	return ifft / X.n_elem;
 }
 
+cube ifft_c2r(cx_cube X, const SizeCube& real_size, const uword half_axis)
+{
+	cube ifft(real_size);
+	execute_fft(fft_dims(real_size), static_cast<int>(half_axis), X.memptr(), ifft.memptr());
+	ifft /= ifft.n_elem;
+
+	return ifft;
+}
+
+#ifdef FFTW_SINGLE
+cx_fcube fft_r2c(fcube X, const uword half_axis)
+{
+	cx_fcube out((half_axis == 0) ? X.n_rows / 2 + 1 : X.n_rows, (half_axis == 1) ? X.n_cols / 2 + 1 : X.n_cols, X.n_slices);
+	execute_fft(fft_dims(arma::size(X)), static_cast<int>(half_axis), X.memptr(), out.memptr());
+
+	return out;
+}
+
+fcube ifft_c2r(cx_fcube X, const SizeCube& real_size, const uword half_axis)
+{
+	fcube ifft(real_size);
+	execute_fft(fft_dims(real_size), static_cast<int>(half_axis), X.memptr(), ifft.memptr());
+	ifft /= static_cast<float>(ifft.n_elem);
+
+	return ifft;
+}
+#endif
+
+namespace {
+	//Fourier components of an axis with n points which are kept on an axis with m points: {source index, target index, weight}
+	//the Nyquist component is split between +/- frequencies when padding and both are folded into it when truncating, so the real data stays real
+	vector<tuple<uword, uword, double>> spectrum_map(const uword n, const uword m) {
+		vector<tuple<uword, uword, double>> map;
+		const uword kept = std::min(n, m);
+		for (uword i = 0; i < (kept + 1) / 2; ++i) {
+			map.emplace_back(i, i, 1.0);
+			if (i > 0) {
+				map.emplace_back(n - i, m - i, 1.0);
+			}
+		}
+		if (kept % 2 == 0) {
+			const uword nyquist = kept / 2;
+			if (n == m) {
+				map.emplace_back(nyquist, nyquist, 1.0);
+			}
+			else if (n < m) {
+				map.emplace_back(nyquist, nyquist, 0.5);
+				map.emplace_back(nyquist, m - nyquist, 0.5);
+			}
+			else {
+				map.emplace_back(nyquist, nyquist, 1.0);
+				map.emplace_back(n - nyquist, nyquist, 1.0);
+			}
+		}
+		return map;
+	}
+}
+
+cube fourier_interp3(const cube& v, const SizeCube& new_size) {
+	if (arma::size(v) == new_size) {
+		return v;
+	}
+	const cx_cube spectrum = fft(v);
+	cx_cube new_spectrum(new_size.n_rows, new_size.n_cols, new_size.n_slices, fill::zeros);
+	const auto map_x = spectrum_map(v.n_rows, new_size.n_rows);
+	const auto map_y = spectrum_map(v.n_cols, new_size.n_cols);
+	const auto map_z = spectrum_map(v.n_slices, new_size.n_slices);
+
+	for (const auto& z : map_z) {
+		for (const auto& y : map_y) {
+			const double weight_yz = get<2>(y) * get<2>(z);
+			for (const auto& x : map_x) {
+				new_spectrum(get<1>(x), get<1>(y), get<1>(z)) += get<2>(x) * weight_yz * spectrum(get<0>(x), get<0>(y), get<0>(z));
+			}
+		}
+	}
+
+	return real(ifft(new_spectrum)) * (static_cast<double>(new_spectrum.n_elem) / v.n_elem);
+}
+
 SizeCube as_size(const urowvec3& vec) {
 	return SizeCube(vec(0), vec(1), vec(2));
 }
@@ -207,49 +626,904 @@ double fmod_p(double num, const double& denom) noexcept {
 
 
 
-cx_cube poisson_solver_3D(const cx_cube& rho, mat diel, rowvec3 lengths, uword normal_direction) {
-	auto n_points = SizeVec(rho);
+namespace {
+	enum class poisson_method { direct, eigen, banded, iterative, multigrid };
+	poisson_method poisson_solver_method = poisson_method::direct;
+	uword poisson_bandwidth = 32;
+
+	//generalized eigendecomposition of the (Az, eps) pair: Az * V = eps * V * diag(lambda) with V' * eps * V = I
+	//returns false if eps is not positive definite
+	bool poisson_eigen_decompose(const cx_mat& Az, const cx_mat& eps, cx_mat& V, vec& lambda) {
+		//eps = R' * R reduces it to the standard Hermitian problem of inv(R') * Az * inv(R)
+		cx_mat R;
+		if (!chol(R, cx_mat((eps + eps.t()) / 2))) {
+			return false;
+		}
+		const cx_mat R_inv = solve(trimatu(R), eye<cx_mat>(arma::size(R)));
+		const cx_mat C = R_inv.t() * Az * R_inv;
+		cx_mat U;
+		if (!eig_sym(lambda, U, cx_mat((C + C.t()) / 2))) {
+			return false;
+		}
+		V = R_inv * U;
+		return true;
+	}
+
+	//eigen basis of the last dielectric profiles: the profiles only change when the interfaces are optimized
+	//the whole (swapped) diel is the key: eps33 of Az may change while eps11 does not (e.g. the same in-plane dielectric inside and outside of the slab)
+	struct poisson_eigen_basis {
+		mat diel;
+		rowvec Gz;
+		cx_mat V;
+		vec lambda;
+		bool valid = false;
+	};
+
+	//returns false if the decomposition is not possible
+	bool poisson_eigen_basis_of(const mat& diel, const rowvec& Gz, const cx_mat& Az, const cx_mat& eps, cx_mat& V, vec& lambda) {
+		static poisson_eigen_basis basis;
+		static mutex basis_mutex;
+		lock_guard<mutex> lock(basis_mutex);
+		const bool cached = (arma::size(basis.diel) == arma::size(diel)) && approx_equal(basis.diel, diel, "absdiff", 0)
+			&& approx_equal(basis.Gz, Gz, "absdiff", 0);
+		if (!cached) {
+			basis.diel = diel;
+			basis.Gz = Gz;
+			basis.valid = poisson_eigen_decompose(Az, eps, basis.V, basis.lambda);
+		}
+		if (basis.valid) {
+			V = basis.V;
+			lambda = basis.lambda;
+		}
+		return basis.valid;
+	}
+
+	//solution of A * X = B for the Hermitian positive definite A (Cholesky factorization), falls back to LU if A is not positive definite
+	template <typename eT>
+	Mat<eT> sympd_solve(const Mat<eT>& A, const Mat<eT>& B) {
+		Mat<eT> R;
+		if (chol(R, A)) {
+			return solve(trimatu(R), solve(trimatl(R.t()), B));
+		}
+		return solve(A, B);
+	}
+
+	//index s of the mirror symmetry of all the profiles: diel(j) == diel((s - j) mod N), the mirror is at s/2. Returns -1 if there is none.
+	sword mirror_symmetry(const mat& diel) {
+		const uword N = diel.n_rows;
+		const double tolerance = 1e-12 * abs(diel).max();
+		for (uword s = 0; s < N; ++s) {
+			bool symmetric = true;
+			for (uword c = 0; symmetric && (c < diel.n_cols); ++c) {
+				const double* profile = diel.colptr(c);
+				for (uword j = 0; j < N; ++j) {
+					if (abs(profile[j] - profile[(s + N - j) % N]) > tolerance) {
+						symmetric = false;
+						break;
+					}
+				}
+			}
+			if (symmetric) {
+				return static_cast<sword>(s);
+			}
+		}
+		return -1;
+	}
+
+	//Fourier coefficients c(d), d = -bandwidth..bandwidth of the (Hermitian) circulant dielectric matrices: one column for each profile
+	cx_mat dielectric_band(const mat& diel, const uword bandwidth) {
+		const cx_mat dielsG = fft(diel) / diel.n_rows;
+		const uword N = diel.n_rows;
+		cx_mat coefficients(2 * bandwidth + 1, diel.n_cols);
+		for (uword d = 0; d <= bandwidth; ++d) {
+			const cx_rowvec upper = dielsG.row(d % N);
+			const cx_rowvec lower = dielsG.row((N - d % N) % N);
+			coefficients.row(bandwidth + d) = (upper + conj(lower)) / 2;
+			coefficients.row(bandwidth - d) = conj(coefficients.row(bandwidth + d));
+		}
+		return coefficients;
+	}
+
+	//solution of AG * X = B with the banded LU (gbsv) for AG(i, j) = c33(i - j) * Gz(i) * Gz(j) + Gx^2 * c11(i - j) + Gy^2 * c22(i - j)
+	//the rows are in the ascending Gz order and the circulant corners (|i - j| > bandwidth) are dropped: the truncated Toeplitz matrix
+	//zero_index: row of Gz = 0 which is pinned for the singular Gx = Gy = 0 system
+	template <typename T>
+	Mat<complex<T>> banded_solve(const Mat<complex<T>>& coefficients, const Col<T>& Gz, const T Gx2, const T Gy2, const sword zero_index, Mat<complex<T>> B) {
+		const uword N = Gz.n_elem;
+		const uword bandwidth = std::min(coefficients.n_rows / 2, N - 1);
+		const uword offset = coefficients.n_rows / 2;
+		Mat<complex<T>> AB(3 * bandwidth + 1, N, fill::zeros);
+		for (uword j = 0; j < N; ++j) {
+			const uword i_first = (j > bandwidth) ? j - bandwidth : 0;
+			const uword i_last = std::min(j + bandwidth, N - 1);
+			for (uword i = i_first; i <= i_last; ++i) {
+				const uword d = offset + i - j;
+				AB(2 * bandwidth + i - j, j) = coefficients(d, 2) * (Gz(i) * Gz(j)) + coefficients(d, 0) * Gx2 + coefficients(d, 1) * Gy2;
+			}
+		}
+		if (zero_index >= 0) {
+			AB(2 * bandwidth, zero_index) = 1;
+		}
 
+		blas_int n = static_cast<blas_int>(N);
+		blas_int kl = static_cast<blas_int>(bandwidth);
+		blas_int ku = kl;
+		blas_int nrhs = static_cast<blas_int>(B.n_cols);
+		blas_int ldab = static_cast<blas_int>(AB.n_rows);
+		blas_int ldb = n;
+		blas_int info = 0;
+		podarray<blas_int> ipiv(N + 2);
+		lapack::gbsv<complex<T>>(&n, &kl, &ku, &nrhs, AB.memptr(), &ldab, ipiv.memptr(), B.memptr(), &ldb, &info);
+		if (info != 0) {
+			//singular truncated matrix: NaNs make the failure visible in the results
+			B.fill(datum::nan);
+		}
+		return B;
+	}
+
+	//forward and backward 1D FFTs of the complex vectors with length n
+	//the plans are looked up once, so the parallel solver loops do not wait for the fft_plans_mutex on each transform
+	template <typename T>
+	struct fft_1D_plans {
+		using api = fftw_api<T>;
+
+		explicit fft_1D_plans(const uword n) : n(n) {
+			Col<complex<T>> in(n), out(n);
+			in_alignment = api::alignment_of(reinterpret_cast<T*>(in.memptr()));
+			out_alignment = api::alignment_of(reinterpret_cast<T*>(out.memptr()));
+			forward = cached_plan<T>({ static_cast<int>(n) }, fft_kind::c2c, FFTW_FORWARD, -1, in.memptr(), out.memptr());
+			backward = cached_plan<T>({ static_cast<int>(n) }, fft_kind::c2c, FFTW_BACKWARD, -1, in.memptr(), out.memptr());
+		}
+
+		//sign = FFTW_FORWARD (no normalization) or FFTW_BACKWARD (normalized by N)
+		Col<complex<T>> operator()(Col<complex<T>> X, const int sign) const {
+			Col<complex<T>> out(n);
+			if ((api::alignment_of(reinterpret_cast<T*>(X.memptr())) == in_alignment) && (api::alignment_of(reinterpret_cast<T*>(out.memptr())) == out_alignment)) {
+				api::execute_dft((sign == FFTW_FORWARD) ? forward : backward, reinterpret_cast<typename api::complex*>(X.memptr()), reinterpret_cast<typename api::complex*>(out.memptr()));
+			}
+			else {
+				execute_fft({ static_cast<int>(n) }, X.memptr(), out.memptr(), sign);
+			}
+			if (sign == FFTW_BACKWARD) {
+				out /= static_cast<T>(n);
+			}
+			return out;
+		}
+
+	private:
+		uword n;
+		int in_alignment, out_alignment;
+		typename api::plan forward, backward;
+	};
+
+	//preconditioned conjugate gradient solution of AG * x = b for a single (Gx, Gy) column, starting from x
+	//AG * v = Gz % fft(eps33(z) % ifft(Gz % v)) + fft((Gx^2 * eps11(z) + Gy^2 * eps22(z)) % ifft(v)) is applied with the FFTs along the normal direction
+	//preconditioner: the same operator for the averaged dielectric profiles which is diagonal in Gz
+	//pinned: the Gz = 0 element of the singular Gx = Gy = 0 system is fixed as in the direct solver (AG(0, 0) = 1)
+	//returns false if the tolerance is not reached. relative_residual: |b - AG * x| / |b| of the result
+	template <typename T>
+	bool poisson_pcg(const fft_1D_plans<T>& fft_1D, const Col<T>& Gz, const Col<T>& eps33, const Col<T>& eps_inplane, const Col<T>& preconditioner, const bool pinned,
+		const Col<complex<T>>& b, Col<complex<T>>& x, T& relative_residual) {
+		const auto AG = [&](const Col<complex<T>>& v) {
+			Col<complex<T>> out = Gz % fft_1D(eps33 % fft_1D(Gz % v, FFTW_BACKWARD), FFTW_FORWARD) + fft_1D(eps_inplane % fft_1D(v, FFTW_BACKWARD), FFTW_FORWARD);
+			if (pinned) {
+				out(0) += v(0);
+			}
+			return out;
+		};
+
+		const T b_norm = norm(b);
+		relative_residual = 0;
+		if (b_norm == 0) {
+			x.zeros();
+			return true;
+		}
+		const T tolerance = std::max(static_cast<T>(1e-10), 10 * numeric_limits<T>::epsilon()) * b_norm;
+		const uword max_iterations = 10 * Gz.n_elem;
+
+		Col<complex<T>> r = b - AG(x);
+		Col<complex<T>> z = r / preconditioner;
+		Col<complex<T>> p = z;
+		T rz = real(cdot(r, z));
+		for (uword iteration = 0; (iteration < max_iterations) && (norm(r) > tolerance); ++iteration) {
+			const Col<complex<T>> Ap = AG(p);
+			const T alpha = rz / real(cdot(p, Ap));
+			x += alpha * p;
+			r -= alpha * Ap;
+			z = r / preconditioner;
+			const T rz_new = real(cdot(r, z));
+			p = z + (rz_new / rz) * p;
+			rz = rz_new;
+		}
+		relative_residual = norm(r) / b_norm;
+		return norm(r) <= tolerance;
+	}
+
+	//Poisson solver for the half spectrum of the charge in the precision T (double or float)
+	//the dielectric matrices and the wave vectors are calculated in double precision
+	template <typename T>
+	Cube<T> poisson_solver_spectrum(const Cube<complex<T>>& rhok, const SizeCube& rho_size, mat diel, rowvec3 lengths, uword normal_direction) {
+		using cx_mat_T = Mat<complex<T>>;
+
+		urowvec3 n_points = { rho_size.n_rows, rho_size.n_cols, rho_size.n_slices };
+
+		if (normal_direction != 2) {
+			n_points.swap_cols(normal_direction, 2);
+			lengths.swap_cols(normal_direction, 2);
+			diel.swap_cols(normal_direction, 2);
+		}
+
+		const rowvec Gs = 2.0 * PI / lengths;
+
+		rowvec Gx0 = ceil(regspace<rowvec>(-0.5 * n_points(0), 0.5 * n_points(0) - 1)) * Gs(0);
+		rowvec Gy0 = ceil(regspace<rowvec>(-0.5 * n_points(1), 0.5 * n_points(1) - 1)) * Gs(1);
+		rowvec Gz0 = ceil(regspace<rowvec>(-0.5 * n_points(2), 0.5 * n_points(2) - 1)) * Gs(2);
+
+		Gx0 = ifftshift(Gx0);
+		Gy0 = ifftshift(Gy0);
+		Gz0 = ifftshift(Gz0);
+
+		//the spectrum of the real charge is Hermitian: only half of it along an in-plane axis is needed
+		const uword half_axis = poisson_half_axis(normal_direction);
+		const uword Gx_number = (half_axis == 0) ? Gx0.n_elem / 2 + 1 : Gx0.n_elem;
+		const uword Gy_number = (half_axis == 1) ? Gy0.n_elem / 2 + 1 : Gy0.n_elem;
+
+		//the dielectric matrices of the real profiles are Hermitian: the round-off asymmetry of the FFT is removed
+		const auto hermitian_toeplitz = [](const cx_vec& column) {
+			const cx_mat eps = circ_toeplitz(column) / column.n_elem;
+			return cx_mat((eps + eps.t()) / 2);
+		};
+		//the banded and the iterative solvers do not need the dense matrices
+		const bool banded = (poisson_solver_method == poisson_method::banded);
+		const bool dense = !banded && (poisson_solver_method != poisson_method::iterative);
+		const cx_mat dielsG = dense ? fft(diel) : cx_mat();
+		const cx_mat eps11_d = dense ? hermitian_toeplitz(dielsG.col(0)) : cx_mat();
+		const cx_mat eps22_d = dense ? hermitian_toeplitz(dielsG.col(1)) : cx_mat();
+		const cx_mat Az_d = dense ? cx_mat(hermitian_toeplitz(dielsG.col(2)) % (Gz0.t() * Gz0)) : cx_mat();
+		const cx_mat_T eps11 = conv_to<cx_mat_T>::from(eps11_d);
+		const cx_mat_T eps22 = conv_to<cx_mat_T>::from(eps22_d);
+		const cx_mat_T Az = conv_to<cx_mat_T>::from(Az_d);
+		Cube<complex<T>> Vk(arma::size(rhok));
+
+		//the spans of the (k, m) column along the normal direction
+		const auto column_spans = [normal_direction](const uword k, const uword m) {
+			vector<span> spans = { span(k), span(m), span() };
+			swap(spans[normal_direction], spans[2]);
+			return spans;
+		};
+
+		//with the isotropic in-plane dielectric (eps11 == eps22): inv(AG) = V * diag(1 / (lambda + Gx^2 + Gy^2)) * V'
+		//all the columns of each Gx are solved together as two matrix products and a scaling
+		cx_mat V_d;
+		vec lambda_d;
+		if ((poisson_solver_method == poisson_method::eigen) && approx_equal(diel.col(0), diel.col(1), "absdiff", 0)
+			&& poisson_eigen_basis_of(diel, Gz0, Az_d, eps11_d, V_d, lambda_d)) {
+			const cx_mat_T V = conv_to<cx_mat_T>::from(V_d);
+			const cx_mat_T Vt = V.t();
+			const Col<T> lambda = conv_to<Col<T>>::from(lambda_d);
+
+#pragma omp parallel for
+			for (uword k = 0; k < Gx_number; ++k) {
+				cx_mat_T rho_columns(Gz0.n_elem, Gy_number);
+				for (uword m = 0; m < Gy_number; ++m) {
+					const auto spans = column_spans(k, m);
+					rho_columns.col(m) = vectorise(rhok(spans[0], spans[1], spans[2]));
+				}
+				cx_mat_T V_columns = Vt * rho_columns;
+				for (uword m = 0; m < Gy_number; ++m) {
+					const T G2 = static_cast<T>(square(Gx0(k)) + square(Gy0(m)));
+					for (uword i = 0; i < lambda.n_elem; ++i) {
+						// 4PI is for the atomic units
+						V_columns(i, m) *= static_cast<T>(4.0 * PI) / (lambda(i) + G2);
+					}
+				}
+				V_columns = V * V_columns;
+				for (uword m = 0; m < Gy_number; ++m) {
+					const auto spans = column_spans(k, m);
+					Vk(spans[0], spans[1], spans[2]) = V_columns.col(m);
+				}
+			}
+
+			//the Gz = 0 mode of the Gx = Gy = 0 column is singular: it is solved directly as in the default solver
+			const auto spans = column_spans(0, 0);
+			cx_mat_T AG = Az;
+			AG(0, 0) = 1;
+			Vk(spans[0], spans[1], spans[2]) = solve(AG, static_cast<T>(4.0 * PI) * vectorise(rhok(spans[0], spans[1], spans[2])));
+		}
+		else if (poisson_solver_method == poisson_method::iterative) {
+			//the solution of the previous call on the same grid is the starting point (the model changes slightly between the optimization steps)
+			static Cube<complex<T>> previous_Vk;
+			static mutex previous_Vk_mutex;
+			{
+				lock_guard<mutex> lock(previous_Vk_mutex);
+				if (arma::size(previous_Vk) == arma::size(rhok)) {
+					Vk = previous_Vk;
+				}
+				else {
+					Vk.zeros();
+				}
+			}
+
+			const Col<T> Gz = conv_to<Col<T>>::from(Gz0);
+			const Col<T> eps11 = conv_to<Col<T>>::from(diel.col(0));
+			const Col<T> eps22 = conv_to<Col<T>>::from(diel.col(1));
+			const Col<T> eps33 = conv_to<Col<T>>::from(diel.col(2));
+			const rowvec eps_mean = mean(diel);
+			const fft_1D_plans<T> fft_1D(Gz.n_elem);
+			//relative residuals of the columns which did not reach the tolerance
+			Mat<T> residuals(Gx_number, Gy_number, fill::zeros);
+
+#pragma omp parallel for collapse(2) schedule(dynamic)
+			for (uword k = 0; k < Gx_number; ++k) {
+				for (uword m = 0; m < Gy_number; ++m) {
+					const auto spans = column_spans(k, m);
+					const double Gx2 = square(Gx0(k));
+					const double Gy2 = square(Gy0(m));
+					const bool pinned = (k == 0) && (m == 0);
+					Col<T> preconditioner = conv_to<Col<T>>::from(eps_mean(2) * square(Gz0.t()) + eps_mean(0) * Gx2 + eps_mean(1) * Gy2);
+					if (pinned) {
+						preconditioner(0) = 1;
+					}
+					Col<complex<T>> V_column = vectorise(Vk(spans[0], spans[1], spans[2]));
+					T relative_residual = 0;
+					// 4PI is for the atomic units
+					if (!poisson_pcg<T>(fft_1D, Gz, eps33, static_cast<T>(Gx2) * eps11 + static_cast<T>(Gy2) * eps22, preconditioner, pinned,
+						static_cast<T>(4.0 * PI) * vectorise(rhok(spans[0], spans[1], spans[2])), V_column, relative_residual)) {
+						residuals(k, m) = relative_residual;
+					}
+					Vk(spans[0], spans[1], spans[2]) = V_column;
+				}
+			}
+			if (residuals.max() > 0) {
+				auto log = spdlog::get("loggers");
+				log->warn("The iterative Poisson solver did not converge for all the wave vectors! Largest relative residual: {}", residuals.max());
+			}
+
+			lock_guard<mutex> lock(previous_Vk_mutex);
+			previous_Vk = Vk;
+		}
+		else {
+			//AG only depends on (Gx^2, Gy^2), or on Gx^2 + Gy^2 if eps11 == eps22: the columns with the same matrix (e.g. +/-Gy) are grouped
+			//and each matrix is factorized once for all of its columns
+			const bool isotropic = approx_equal(diel.col(0), diel.col(1), "absdiff", 0);
+			map<pair<double, double>, vector<pair<uword, uword>>> groups_map;
+			for (uword k = 0; k < Gx_number; ++k) {
+				for (uword m = 0; m < Gy_number; ++m) {
+					const double Gx2 = square(Gx0(k));
+					const double Gy2 = square(Gy0(m));
+					groups_map[isotropic ? make_pair(Gx2 + Gy2, 0.0) : make_pair(Gx2, Gy2)].emplace_back(k, m);
+				}
+			}
+			const vector<vector<pair<uword, uword>>> groups = [&groups_map] {
+				vector<vector<pair<uword, uword>>> columns;
+				for (auto& group : groups_map) {
+					columns.push_back(move(group.second));
+				}
+				return columns;
+			}();
+
+			//a profile which is mirror-symmetric at s/2 has the spectrum exp(-i*PI*s*k/N) * real(k): with P = diag(exp(-i*PI*s*j/N))
+			//AG = P * AG_real * P' and the systems are solved in the real arithmetic as AG_real * (P' * V) = P' * rho
+			const sword mirror = banded ? -1 : mirror_symmetry(diel);
+			Mat<T> Az_real, eps11_real, eps22_real;
+			Col<complex<T>> phase;
+			if (mirror >= 0) {
+				const cx_vec P = exp(cx_double(0, -PI * mirror / Gz0.n_elem) * regspace<vec>(0, Gz0.n_elem - 1));
+				const cx_mat PP = conj(P) * P.st();
+				Az_real = conv_to<Mat<T>>::from(real(Az_d % PP));
+				eps11_real = conv_to<Mat<T>>::from(real(eps11_d % PP));
+				eps22_real = conv_to<Mat<T>>::from(real(eps22_d % PP));
+				phase = conv_to<Col<complex<T>>>::from(P);
+			}
+
+			//banded solver: Gz in the ascending order (the rows of Gz0 in that order) and the truncated dielectric spectrum
+			uvec ascending_Gz;
+			Col<T> Gz_ascending;
+			cx_mat_T band_coefficients;
+			sword zero_index = -1;
+			if (banded) {
+				ascending_Gz = stable_sort_index(Gz0);
+				Gz_ascending = conv_to<Col<T>>::from(Gz0.elem(ascending_Gz));
+				band_coefficients = conv_to<cx_mat_T>::from(dielectric_band(diel, poisson_bandwidth));
+				zero_index = static_cast<sword>(as_scalar(find(ascending_Gz == 0, 1)));
+			}
+
+#pragma omp parallel for schedule(dynamic) firstprivate(Az,eps11,eps22,Az_real,eps11_real,eps22_real)
+			for (uword g = 0; g < groups.size(); ++g) {
+				const auto& columns = groups[g];
+				const uword k0 = columns.front().first;
+				const uword m0 = columns.front().second;
+				const T Gx2 = static_cast<T>(square(Gx0(k0)));
+				const T Gy2 = static_cast<T>(square(Gy0(m0)));
+				cx_mat_T rho_columns(Gz0.n_elem, columns.size());
+				for (uword c = 0; c < columns.size(); ++c) {
+					const auto spans = column_spans(columns[c].first, columns[c].second);
+					rho_columns.col(c) = vectorise(rhok(spans[0], spans[1], spans[2]));
+				}
+				// 4PI is for the atomic units
+				rho_columns *= static_cast<T>(4.0 * PI);
+
+				cx_mat_T V_columns;
+				if (banded) {
+					const cx_mat_T V_ascending = banded_solve(band_coefficients, Gz_ascending, Gx2, Gy2, ((k0 == 0) && (m0 == 0)) ? zero_index : -1, cx_mat_T(rho_columns.rows(ascending_Gz)));
+					V_columns.set_size(arma::size(V_ascending));
+					V_columns.rows(ascending_Gz) = V_ascending;
+				}
+				else if (mirror >= 0) {
+					Mat<T> AG = Az_real + eps11_real * Gx2 + eps22_real * Gy2;
+					if ((k0 == 0) && (m0 == 0)) { AG(0, 0) = 1; }
+					rho_columns.each_col() %= conj(phase);
+					const Mat<T> V_real = sympd_solve(AG, Mat<T>(join_rows(real(rho_columns), imag(rho_columns))));
+					V_columns = cx_mat_T(V_real.head_cols(columns.size()), V_real.tail_cols(columns.size()));
+					V_columns.each_col() %= phase;
+				}
+				else {
+					cx_mat_T AG = Az + eps11 * Gx2 + eps22 * Gy2;
+					if ((k0 == 0) && (m0 == 0)) { AG(0, 0) = 1; }
+					V_columns = sympd_solve(AG, rho_columns);
+				}
+				for (uword c = 0; c < columns.size(); ++c) {
+					const auto spans = column_spans(columns[c].first, columns[c].second);
+					Vk(spans[0], spans[1], spans[2]) = V_columns.col(c);
+				}
+			}
+		}
+		// 0,0,0 in k-space corresponds to a constant in the real space: average potential over the supercell.
+		Vk(0, 0, 0) = 0;
+
+		return ifft_c2r(Vk, rho_size, half_axis);
+	}
+}
+
+namespace {
+	//one level of the multigrid hierarchy with the normal direction along the slices
+	//eps_x, eps_y: in-plane dielectric profiles at the nodes. eps_z: normal dielectric profile at the faces between the slices k and k + 1
+	struct multigrid_level {
+		cube V, f;
+		vec eps_x, eps_y, eps_z;
+		rowvec3 h;
+		//axes which are coarsened towards the next level
+		array<bool, 3> coarsened = { { false, false, false } };
+	};
+
+	//swaps the axis with the slices (its own inverse)
+	cube swap_with_slices(const cube& X, const uword axis) {
+		if (axis == 2) {
+			return X;
+		}
+		cube Y = (axis == 0) ? cube(X.n_slices, X.n_cols, X.n_rows) : cube(X.n_rows, X.n_slices, X.n_cols);
+#pragma omp parallel for
+		for (uword k = 0; k < X.n_slices; ++k) {
+			for (uword j = 0; j < X.n_cols; ++j) {
+				for (uword i = 0; i < X.n_rows; ++i) {
+					if (axis == 0) {
+						Y(k, j, i) = X(i, j, k);
+					}
+					else {
+						Y(i, k, j) = X(i, j, k);
+					}
+				}
+			}
+		}
+		return Y;
+	}
+
+	//-div(eps * grad(V)) with the second order finite differences on the periodic grid
+	//rows: the contribution of the 6 neighbors, otherwise: the diagonal coefficients (for each slice)
+	struct multigrid_stencil {
+		vec cx, cy, cz, diagonal;
+		explicit multigrid_stencil(const multigrid_level& level) {
+			cx = level.eps_x / square(level.h(0));
+			cy = level.eps_y / square(level.h(1));
+			cz = level.eps_z / square(level.h(2));
+			diagonal = 2 * cx + 2 * cy + cz + shift(cz, 1);
+		}
+
+		double neighbors(const cube& V, const uword i, const uword j, const uword k) const {
+			const uword n0 = V.n_rows, n1 = V.n_cols, n2 = V.n_slices;
+			const uword km = (k + n2 - 1) % n2;
+			return cx(k) * (V((i + 1) % n0, j, k) + V((i + n0 - 1) % n0, j, k))
+				+ cy(k) * (V(i, (j + 1) % n1, k) + V(i, (j + n1 - 1) % n1, k))
+				+ cz(k) * V(i, j, (k + 1) % n2) + cz(km) * V(i, j, km);
+		}
+	};
+
+	cube multigrid_residual(const multigrid_level& level, const multigrid_stencil& A) {
+		cube r(arma::size(level.f));
+#pragma omp parallel for
+		for (uword k = 0; k < r.n_slices; ++k) {
+			for (uword j = 0; j < r.n_cols; ++j) {
+				for (uword i = 0; i < r.n_rows; ++i) {
+					r(i, j, k) = level.f(i, j, k) - A.diagonal(k) * level.V(i, j, k) + A.neighbors(level.V, i, j, k);
+				}
+			}
+		}
+		return r;
+	}
+
+	//red-black Gauss-Seidel sweeps (black-red if reversed). The colors are not independent on the periodic grids with odd sizes: weighted Jacobi is used instead
+	void multigrid_smooth(multigrid_level& level, const multigrid_stencil& A, const uword sweeps, const bool reversed) {
+		cube& V = level.V;
+		const bool red_black = (V.n_rows % 2 == 0) && (V.n_cols % 2 == 0) && (V.n_slices % 2 == 0);
+		for (uword sweep = 0; sweep < sweeps; ++sweep) {
+			if (red_black) {
+				for (uword c = 0; c < 2; ++c) {
+					const uword color = reversed ? 1 - c : c;
+#pragma omp parallel for
+					for (uword k = 0; k < V.n_slices; ++k) {
+						for (uword j = 0; j < V.n_cols; ++j) {
+							for (uword i = (j + k + color) % 2; i < V.n_rows; i += 2) {
+								V(i, j, k) = (level.f(i, j, k) + A.neighbors(V, i, j, k)) / A.diagonal(k);
+							}
+						}
+					}
+				}
+			}
+			else {
+				const cube r = multigrid_residual(level, A);
+#pragma omp parallel for
+				for (uword k = 0; k < V.n_slices; ++k) {
+					V.slice(k) += 0.8 * r.slice(k) / A.diagonal(k);
+				}
+			}
+		}
+	}
+
+	//Jacobi preconditioned conjugate gradient for the correction of V on the coarsest level
+	//the residual is projected to the range of the periodic operator (zero average)
+	void multigrid_coarsest_solve(multigrid_level& level, const multigrid_stencil& A) {
+		multigrid_level correction;
+		correction.f = multigrid_residual(level, A);
+		correction.f -= accu(correction.f) / correction.f.n_elem;
+		const auto precondition = [&A](cube r) {
+			for (uword k = 0; k < r.n_slices; ++k) {
+				r.slice(k) /= A.diagonal(k);
+			}
+			return r;
+		};
+		const auto apply = [&A](const cube& p) {
+			multigrid_level p_level;
+			p_level.V = p;
+			p_level.f.zeros(arma::size(p));
+			return cube(-multigrid_residual(p_level, A));
+		};
+
+		const double tolerance = 1e-6 * norm(vectorise(correction.f));
+		const uword max_iterations = std::max(correction.f.n_elem, uword(100));
+		cube e(arma::size(correction.f), fill::zeros);
+		cube r = correction.f;
+		cube z = precondition(r);
+		cube p = z;
+		double rz = accu(r % z);
+		for (uword iteration = 0; (iteration < max_iterations) && (norm(vectorise(r)) > tolerance); ++iteration) {
+			const cube Ap = apply(p);
+			const double alpha = rz / accu(p % Ap);
+			e += alpha * p;
+			r -= alpha * Ap;
+			z = precondition(r);
+			const double rz_new = accu(r % z);
+			p = z + (rz_new / rz) * p;
+			rz = rz_new;
+		}
+		level.V += e;
+	}
+
+	//full weighting (1/4, 1/2, 1/4) of the periodic data along the axis on the even nodes
+	cube restrict_axis(const cube& X, const uword axis) {
+		const array<uword, 3> n = { { X.n_rows, X.n_cols, X.n_slices } };
+		array<uword, 3> nc = n;
+		nc[axis] /= 2;
+		cube Y(nc[0], nc[1], nc[2]);
+#pragma omp parallel for
+		for (uword k = 0; k < nc[2]; ++k) {
+			array<uword, 3> index = { { 0, 0, k } };
+			for (index[1] = 0; index[1] < nc[1]; ++index[1]) {
+				for (index[0] = 0; index[0] < nc[0]; ++index[0]) {
+					array<uword, 3> fine = index;
+					fine[axis] = 2 * index[axis];
+					array<uword, 3> before = fine, after = fine;
+					before[axis] = (fine[axis] + n[axis] - 1) % n[axis];
+					after[axis] = (fine[axis] + 1) % n[axis];
+					Y(index[0], index[1], index[2]) = 0.5 * X(fine[0], fine[1], fine[2]) + 0.25 * (X(before[0], before[1], before[2]) + X(after[0], after[1], after[2]));
+				}
+			}
+		}
+		return Y;
+	}
+
+	//linear interpolation of the periodic data along the axis to the twice finer grid
+	cube prolong_axis(const cube& Y, const uword axis) {
+		const array<uword, 3> nc = { { Y.n_rows, Y.n_cols, Y.n_slices } };
+		array<uword, 3> n = nc;
+		n[axis] *= 2;
+		cube X(n[0], n[1], n[2]);
+#pragma omp parallel for
+		for (uword k = 0; k < n[2]; ++k) {
+			array<uword, 3> index = { { 0, 0, k } };
+			for (index[1] = 0; index[1] < n[1]; ++index[1]) {
+				for (index[0] = 0; index[0] < n[0]; ++index[0]) {
+					array<uword, 3> coarse = index;
+					coarse[axis] = index[axis] / 2;
+					if (index[axis] % 2 == 0) {
+						X(index[0], index[1], index[2]) = Y(coarse[0], coarse[1], coarse[2]);
+					}
+					else {
+						array<uword, 3> next = coarse;
+						next[axis] = (coarse[axis] + 1) % nc[axis];
+						X(index[0], index[1], index[2]) = 0.5 * (Y(coarse[0], coarse[1], coarse[2]) + Y(next[0], next[1], next[2]));
+					}
+				}
+			}
+		}
+		return X;
+	}
+
+	//next level of the hierarchy: the axes with the finest spacing are coarsened (only the normal direction for the fine normal grids)
+	//returns false if no axis can be coarsened
+	bool multigrid_coarsen(multigrid_level& fine, multigrid_level& coarse) {
+		const array<uword, 3> n = { { fine.f.n_rows, fine.f.n_cols, fine.f.n_slices } };
+		const double h_min = fine.h.min();
+		bool any_coarsened = false;
+		for (uword axis = 0; axis < 3; ++axis) {
+			fine.coarsened[axis] = (n[axis] % 2 == 0) && (n[axis] >= 4) && (fine.h(axis) < 1.5 * h_min);
+			any_coarsened = any_coarsened || fine.coarsened[axis];
+		}
+		if (!any_coarsened) {
+			return false;
+		}
+
+		coarse.h = fine.h;
+		coarse.eps_x = fine.eps_x;
+		coarse.eps_y = fine.eps_y;
+		coarse.eps_z = fine.eps_z;
+		for (uword axis = 0; axis < 3; ++axis) {
+			if (fine.coarsened[axis]) {
+				coarse.h(axis) *= 2;
+			}
+		}
+		if (fine.coarsened[2]) {
+			const uword nc = n[2] / 2;
+			for (uword K = 0; K < nc; ++K) {
+				const uword k = 2 * K;
+				const uword km = (k + n[2] - 1) % n[2];
+				coarse.eps_x(K) = 0.5 * fine.eps_x(k) + 0.25 * (fine.eps_x(km) + fine.eps_x(k + 1));
+				coarse.eps_y(K) = 0.5 * fine.eps_y(k) + 0.25 * (fine.eps_y(km) + fine.eps_y(k + 1));
+				//the two fine faces are in series
+				coarse.eps_z(K) = 2 / (1 / fine.eps_z(k) + 1 / fine.eps_z(k + 1));
+			}
+			coarse.eps_x.resize(nc);
+			coarse.eps_y.resize(nc);
+			coarse.eps_z.resize(nc);
+		}
+		array<uword, 3> nc = n;
+		for (uword axis = 0; axis < 3; ++axis) {
+			if (fine.coarsened[axis]) {
+				nc[axis] /= 2;
+			}
+		}
+		coarse.V.zeros(nc[0], nc[1], nc[2]);
+		coarse.f.zeros(nc[0], nc[1], nc[2]);
+		return true;
+	}
+
+	void multigrid_cycle(vector<multigrid_level>& levels, const vector<multigrid_stencil>& stencils, const uword l) {
+		multigrid_level& level = levels[l];
+		if (l + 1 == levels.size()) {
+			multigrid_coarsest_solve(level, stencils[l]);
+			return;
+		}
+
+		multigrid_smooth(level, stencils[l], 2, false);
+		cube r = multigrid_residual(level, stencils[l]);
+		for (uword axis = 0; axis < 3; ++axis) {
+			if (level.coarsened[axis]) {
+				r = restrict_axis(r, axis);
+			}
+		}
+		levels[l + 1].f = r;
+		levels[l + 1].V.zeros(arma::size(r));
+		multigrid_cycle(levels, stencils, l + 1);
+
+		cube correction = levels[l + 1].V;
+		for (uword axis = 0; axis < 3; ++axis) {
+			if (level.coarsened[axis]) {
+				correction = prolong_axis(correction, axis);
+			}
+		}
+		level.V += correction;
+		multigrid_smooth(level, stencils[l], 2, true);
+	}
+
+	//the operator of the reciprocal space solver applied in the real space: -div(eps * grad(V)) with the spectral derivatives
+	//it is complex at the Nyquist frequencies of the even grids as in poisson_solver_3D. The normal direction is along the slices
+	struct spectral_poisson_operator {
+		rowvec Gx, Gy, Gz;
+		vec eps_x, eps_y, eps_z;
+
+		spectral_poisson_operator(const SizeCube& size, const rowvec3& lengths, const mat& diel) : eps_x(diel.col(0)), eps_y(diel.col(1)), eps_z(diel.col(2)) {
+			const auto wave_vectors = [](const uword n, const double length) {
+				return rowvec(ifftshift(rowvec(ceil(regspace<rowvec>(-0.5 * n, 0.5 * n - 1)) * 2.0 * PI / length)));
+			};
+			Gx = wave_vectors(size.n_rows, lengths(0));
+			Gy = wave_vectors(size.n_cols, lengths(1));
+			Gz = wave_vectors(size.n_slices, lengths(2));
+		}
+
+		cx_cube apply(const cx_cube& V) const {
+			const cx_cube Vk = fft(V);
+			cx_cube dz(arma::size(Vk)), dxy(arma::size(Vk));
+#pragma omp parallel for
+			for (uword k = 0; k < Vk.n_slices; ++k) {
+				for (uword j = 0; j < Vk.n_cols; ++j) {
+					for (uword i = 0; i < Vk.n_rows; ++i) {
+						dz(i, j, k) = Gz(k) * Vk(i, j, k);
+					}
+				}
+			}
+			dz = ifft(dz);
+			for (uword k = 0; k < dz.n_slices; ++k) {
+				dz.slice(k) *= eps_z(k);
+			}
+			dz = fft(dz);
+			//the in-plane terms: eps_x(z) * Gx^2 + eps_y(z) * Gy^2
+			cx_cube out(arma::size(V), fill::zeros);
+			for (uword axis = 0; axis < 2; ++axis) {
+				const rowvec& G = (axis == 0) ? Gx : Gy;
+				const vec& eps = (axis == 0) ? eps_x : eps_y;
+#pragma omp parallel for
+				for (uword k = 0; k < Vk.n_slices; ++k) {
+					for (uword j = 0; j < Vk.n_cols; ++j) {
+						for (uword i = 0; i < Vk.n_rows; ++i) {
+							dxy(i, j, k) = square(G((axis == 0) ? i : j)) * Vk(i, j, k);
+						}
+					}
+				}
+				const cx_cube d2 = ifft(dxy);
+				for (uword k = 0; k < out.n_slices; ++k) {
+					out.slice(k) += eps(k) * d2.slice(k);
+				}
+			}
+#pragma omp parallel for
+			for (uword k = 0; k < dz.n_slices; ++k) {
+				dz.slice(k) *= Gz(k);
+			}
+			return out + ifft(dz);
+		}
+	};
+}
+
+cube poisson_solver_multigrid(const cube& rho, mat diel, rowvec3 lengths, uword normal_direction) {
 	if (normal_direction != 2) {
-		n_points.swap_cols(normal_direction, 2);
 		lengths.swap_cols(normal_direction, 2);
 		diel.swap_cols(normal_direction, 2);
 	}
 
-	const rowvec Gs = 2.0 * PI / lengths;
+	vector<multigrid_level> levels(1);
+	multigrid_level& finest = levels.front();
+	// 4PI is for the atomic units. The average charge is a constant potential as in the reciprocal space solver.
+	finest.f = swap_with_slices(rho, normal_direction);
+	finest.f = 4.0 * PI * (finest.f - accu(finest.f) / finest.f.n_elem);
+	finest.V.zeros(arma::size(finest.f));
+	finest.h = lengths / rowvec3{ double(finest.f.n_rows), double(finest.f.n_cols), double(finest.f.n_slices) };
+	finest.eps_x = diel.col(0);
+	finest.eps_y = diel.col(1);
+	finest.eps_z = (diel.col(2) + shift(diel.col(2), -1)) / 2;
 
-	rowvec Gx0 = ceil(regspace<rowvec>(-0.5 * n_points(0), 0.5 * n_points(0) - 1)) * Gs(0);
-	rowvec Gy0 = ceil(regspace<rowvec>(-0.5 * n_points(1), 0.5 * n_points(1) - 1)) * Gs(1);
-	rowvec Gz0 = ceil(regspace<rowvec>(-0.5 * n_points(2), 0.5 * n_points(2) - 1)) * Gs(2);
+	while (true) {
+		multigrid_level coarse;
+		if (!multigrid_coarsen(levels.back(), coarse)) {
+			break;
+		}
+		levels.push_back(move(coarse));
+	}
+	//the coarsening stops at the odd sizes of the finest axes (e.g. Nz = 225). Coarsening only the other axes does not reduce
+	//the strongly coupled errors along the fine axis, and the coarsest level solver on a large grid is neither fast nor O(N)
+	const uword max_coarsest_size = 4096;
+	if (levels.back().f.n_elem > max_coarsest_size) {
+		static once_flag warned;
+		call_once(warned, [] {
+			auto log = spdlog::get("loggers");
+			log->warn("The grid sizes along the finest axes cannot be halved enough times for the multigrid Poisson solver (odd sizes)! "
+				"The direct solver will be used for these grids.");
+		});
+		if (normal_direction != 2) {
+			lengths.swap_cols(normal_direction, 2);
+			diel.swap_cols(normal_direction, 2);
+		}
+		return poisson_solver_spectrum<double>(fft_r2c(rho, poisson_half_axis(normal_direction)), arma::size(rho), diel, lengths, normal_direction);
+	}
+	vector<multigrid_stencil> stencils;
+	for (const auto& level : levels) {
+		stencils.emplace_back(level);
+	}
 
-	Gx0 = ifftshift(Gx0);
-	Gy0 = ifftshift(Gy0);
-	Gz0 = ifftshift(Gz0);
+	//the multigrid V-cycle of the finite differences is the preconditioner of the flexible conjugate gradient on the operator of the reciprocal space solver
+	//(which is the same potential as poisson_solver_3D and not only its second order approximation)
+	const auto precondition_part = [&levels, &stencils](const cube& r) {
+		multigrid_level& level = levels.front();
+		level.f = r - accu(r) / r.n_elem;
+		level.V.zeros(arma::size(r));
+		multigrid_cycle(levels, stencils, 0);
+		return cube(level.V - accu(level.V) / level.V.n_elem);
+	};
+	const auto precondition = [&precondition_part](const cx_cube& r) {
+		return cx_cube(precondition_part(real(r)), precondition_part(imag(r)));
+	};
+	const auto inner_product = [](const cx_cube& a, const cx_cube& b) {
+		return accu(real(a) % real(b) + imag(a) % imag(b));
+	};
+	const spectral_poisson_operator A(arma::size(levels.front().f), lengths, diel);
 
-	// 4PI is for the atomic units
-	const auto rhok = fft(cx_cube(4.0 * PI * rho));
+	cx_cube r(levels.front().f, cube(arma::size(levels.front().f), fill::zeros));
+	cx_cube Vc(arma::size(r), fill::zeros);
+	const double f_norm = norm(vectorise(r));
+	const double tolerance = 1e-10 * f_norm;
+	cx_cube z = precondition(r);
+	cx_cube p = z;
+	double rz = inner_product(r, z);
+	const uword max_iterations = 100;
+	for (uword iteration = 0; (iteration < max_iterations) && (norm(vectorise(r)) > tolerance); ++iteration) {
+		const cx_cube Ap = A.apply(p);
+		const double alpha = rz / inner_product(p, Ap);
+		Vc += alpha * p;
+		r -= alpha * Ap;
+		const cx_cube z_new = precondition(r);
+		const double rz_new = inner_product(r, z_new);
+		p = z_new + (inner_product(r, z_new - z) / rz) * p;
+		z = z_new;
+		rz = rz_new;
+	}
+	if (norm(vectorise(r)) > tolerance) {
+		auto log = spdlog::get("loggers");
+		log->warn("The multigrid Poisson solver did not converge in {} iterations! Relative residual: {}", max_iterations, norm(vectorise(r)) / f_norm);
+	}
+
+	cube V = real(Vc);
+	V -= accu(V) / V.n_elem;
+	return swap_with_slices(V, normal_direction);
+}
+
+void set_poisson_solver(const string& solver, const uword bandwidth) {
+	poisson_solver_method = (solver == "eigen") ? poisson_method::eigen : (solver == "banded") ? poisson_method::banded
+		: (solver == "iterative") ? poisson_method::iterative : (solver == "multigrid") ? poisson_method::multigrid : poisson_method::direct;
+	poisson_bandwidth = bandwidth;
+}
+
+double dielectric_band_truncation_error(const mat& diel, const uword bandwidth) {
 	const cx_mat dielsG = fft(diel);
-	const cx_mat eps11 = circ_toeplitz(dielsG.col(0)) / Gz0.n_elem;
-	const cx_mat eps22 = circ_toeplitz(dielsG.col(1)) / Gz0.n_elem;
-	const cx_mat eps33 = circ_toeplitz(dielsG.col(2)) / Gz0.n_elem;
-	const mat GzGzp = Gz0.t() * Gz0;
-	const cx_mat Az = eps33 % GzGzp;
-	cx_cube Vk(arma::size(rhok));
-
-#pragma omp parallel for firstprivate(Az,eps11,eps22,rhok)
-	for (uword k = 0; k < Gx0.n_elem; ++k) {
-		const cx_mat eps11_Gx0k2 = eps11 * square(Gx0(k));
-		for (uword m = 0; m < Gy0.n_elem; ++m) {
-			vector<span> spans = { span(k), span(m), span() };
-			swap(spans[normal_direction], spans[2]);
-			cx_mat AG = Az + eps11_Gx0k2 + eps22 * square(Gy0(m));
-			if ((k == 0) && (m == 0)) { AG(0, 0) = 1; }
-			Vk(spans[0], spans[1], spans[2]) = solve(AG, vectorise(rhok(spans[0], spans[1], spans[2])));
+	const uword N = diel.n_rows;
+	double error = 0;
+	for (uword c = 0; c < diel.n_cols; ++c) {
+		double dropped = 0;
+		for (uword k = 0; k < N; ++k) {
+			if (std::min(k, N - k) > bandwidth) {
+				dropped += norm(dielsG(k, c));
+			}
 		}
+		error = std::max(error, sqrt(dropped) / norm(dielsG.col(c)));
 	}
-	// 0,0,0 in k-space corresponds to a constant in the real space: average potential over the supercell.
-	Vk(0, 0, 0) = 0;
-	const cx_cube V = ifft(Vk);
+	return error;
+}
+
+cube poisson_solver_3D(const cube& rho, mat diel, rowvec3 lengths, uword normal_direction) {
+	if (poisson_solver_method == poisson_method::multigrid) {
+		return poisson_solver_multigrid(rho, diel, lengths, normal_direction);
+	}
+	return poisson_solver_3D(fft_r2c(rho, poisson_half_axis(normal_direction)), arma::size(rho), diel, lengths, normal_direction);
+}
 
-	return V;
+cube poisson_solver_3D(const cx_cube& rhok, const SizeCube& rho_size, mat diel, rowvec3 lengths, uword normal_direction) {
+	if (poisson_solver_method == poisson_method::multigrid) {
+		return poisson_solver_multigrid(ifft_c2r(rhok, rho_size, poisson_half_axis(normal_direction)), diel, lengths, normal_direction);
+	}
+	return poisson_solver_spectrum(rhok, rho_size, diel, lengths, normal_direction);
+}
+
+#ifdef FFTW_SINGLE
+fcube poisson_solver_3D(const cx_fcube& rhok, const SizeCube& rho_size, mat diel, rowvec3 lengths, uword normal_direction) {
+	if (poisson_solver_method == poisson_method::multigrid) {
+		return conv_to<fcube>::from(poisson_solver_multigrid(conv_to<cube>::from(ifft_c2r(rhok, rho_size, poisson_half_axis(normal_direction))), diel, lengths, normal_direction));
+	}
+	return poisson_solver_spectrum(rhok, rho_size, diel, lengths, normal_direction);
 }
+#endif
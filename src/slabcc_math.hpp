@@ -3,9 +3,16 @@
 // See the accompanying LICENSE.txt file for terms.
 
 #pragma once
+#include <array>
+#include <map>
 #include <armadillo>
 #include "arma_io.hpp"
 #include <fftw3.h>
+
+//single precision FFTs (fftwf) are included in the MKL, otherwise the fftw3f library is needed
+#if defined(FFTW_FLOAT) || defined(MKL)
+#define FFTW_SINGLE
+#endif
 #include "general_io.hpp"
 #include "spline.hpp"
 
@@ -17,15 +24,15 @@
 // fft/ifft functions for cube files: Wrappers for FFTW with MATLAB/Octave scaling convention
 //				in FFT functions the forward FFT scales by 1, and the reverse scales by 1/N. 
 // 3D ndgrid and 3D meshgrid
-// 3D spline interpolation
-// 3D shift: by number of the elements along one axis or with a relative 3D shift vector
+// 3D spline and Fourier interpolation
+// 3D shift: by number of the elements along each axis or with a relative 3D shift vector
 // irowvec to matrix/cube size conversion
 // scalar triple product
 
 
 using namespace arma;
 
-// a (very inefficient) 3D spline interpolation!
+// 3D natural cubic spline interpolation (separable, all lines of each pass are resampled together)
 cube interp3(const rowvec& x, const rowvec& y, const rowvec& z, const cube& v, const rowvec& xi, const rowvec& yi, const rowvec& zi);
 cube interp3(const cube& v, const rowvec& xi, const rowvec& yi, const rowvec& zi);
 
@@ -36,12 +43,29 @@ tuple<cube, cube, cube> ndgrid(const rowvec& v1, const rowvec& v2, const rowvec&
 tuple<cube, cube, cube> meshgrid(const rowvec& v1, const rowvec& v2, const rowvec& v3);
 
 //shifts a cube by a relative 3D vector [0 1]
-cube shift(cube cube_in, rowvec3 shifts);
+cube shift(const cube& cube_in, rowvec3 shifts);
+
+//adds the outer product of three vectors to the cube: A(i, j, k) += x(i) * y(j) * z(k)
+//the cube size must be (x.n_elem, y.n_elem, z.n_elem)
+void add_outer_product(cube& A, const rowvec& x, const rowvec& y, const rowvec& z);
+
+//adds a Gaussian to the cube: A(i, j, k) += scale * exp(-r^T inv_covariance r / 2) with r = (x(i), y(j), z(k))
+//the cube size must be (x.n_elem, y.n_elem, z.n_elem)
+void add_gaussian(cube& A, const rowvec& x, const rowvec& y, const rowvec& z, const mat33& inv_covariance, const double scale);
+
+//Planar sums of the cubes in all directions ({x, y, z} for each cube)
+//all the cubes are reduced in a single parallel pass over their slices
+vector<array<vec, 3>> planar_sums(const vector<const cube*>& cubes_in);
 
-//Planar average of a cube in the defined direction
-//direction: 0,1,2 > x,y,z
-vec planar_average(const uword& direction, const cube& cube_in);
 
+//the FFTW plans of the fft/ifft functions are created once for each shape, type, direction and memory alignment and reused
+//planner: "estimate", "measure" or "patient" (FFTW_ESTIMATE/FFTW_MEASURE/FFTW_PATIENT). Changing it drops the cached plans.
+void set_fft_planner(const string& planner);
+
+//FFTW wisdom (accumulated planner results) can be saved and loaded to skip the planning in the next runs
+//the wisdom of the single precision FFTs (FFTW_SINGLE) is in a second file: file_name + ".float"
+bool import_fft_wisdom(const string& file_name);
+bool export_fft_wisdom(const string& file_name);
 
 //1D FFT of complex data.
 //no normalization for forward FFT
@@ -60,6 +84,11 @@ cx_cube fft(cx_cube X);
 //no normalization for forward FFT
 cx_cube fft(cube X);
 
+//3D FFT of real data to its half spectrum: only the first n/2+1 elements along the half_axis (0 or 1) are stored
+//the rest of the spectrum is the complex conjugate of the stored part.
+//no normalization for forward FFT
+cx_cube fft_r2c(cube X, const uword half_axis = 0);
+
 //1D inverse FFT of complex data.
 //normalized by N = X.n_elem
 cx_vec ifft(cx_vec X);
@@ -68,6 +97,20 @@ cx_vec ifft(cx_vec X);
 //normalized by N = X.n_elem
 cx_cube ifft(cx_cube X);
 
+//3D inverse FFT of the half spectrum of real data (see fft_r2c) with the size of the real data: real_size
+//normalized by N = real_size elements
+cube ifft_c2r(cx_cube X, const SizeCube& real_size, const uword half_axis = 0);
+
+#ifdef FFTW_SINGLE
+//single precision versions of fft_r2c and ifft_c2r
+cx_fcube fft_r2c(fcube X, const uword half_axis = 0);
+fcube ifft_c2r(cx_fcube X, const SizeCube& real_size, const uword half_axis = 0);
+#endif
+
+//resamples the periodic data on the grid size new_size by zero-padding or truncating its Fourier spectrum
+//the new grid starts at the same point and covers the same period (exact for the band-limited data)
+cube fourier_interp3(const cube& v, const SizeCube& new_size);
+
 //returns a cube size object from the values inside a vector
 SizeCube as_size(const urowvec3& vec);
 
@@ -91,27 +134,70 @@ inline double square(const double& input) noexcept {
 
 //Poisson solver in 3D with anisotropic dielectric profiles
 //diel is the N*3 matrix of variations in dielectric tensor elements in direction normal to the surface
-cx_cube poisson_solver_3D(const cx_cube& rho, mat diel, rowvec3 lengths, uword normal_direction);
+//the equations are only solved for the non-redundant half of the (Gx, Gy) plane of the real charge density
+//the columns which share the same matrix (same Gx^2, Gy^2) are solved together with a single factorization
+//the matrices are Hermitian positive definite (Cholesky), and real for the mirror-symmetric dielectric profiles (up to a phase)
+cube poisson_solver_3D(const cube& rho, mat diel, rowvec3 lengths, uword normal_direction);
+
+//Poisson solver in 3D for the charge density given by its half spectrum: fft_r2c(rho, poisson_half_axis(normal_direction))
+//rho_size is the grid size of the charge density in the real space
+cube poisson_solver_3D(const cx_cube& rhok, const SizeCube& rho_size, mat diel, rowvec3 lengths, uword normal_direction);
+
+//method of the linear solves in the Poisson solver: "direct" (default), "eigen", "banded", "iterative" or "multigrid"
+//eigen: one generalized eigendecomposition of the dielectric profile replaces the dense solves of all the (Gx, Gy) columns (only for eps11 == eps22, otherwise the direct solver is used)
+//banded: the dielectric spectrum is truncated to |k| <= bandwidth and each system is solved as a banded (Toeplitz) matrix in O(Nz * bandwidth^2)
+//iterative: preconditioned conjugate gradient with the FFTs along the normal direction in O(Nz * log(Nz)) per iteration, starting from the previous solution
+//multigrid: poisson_solver_multigrid is used instead
+void set_poisson_solver(const string& solver, const uword bandwidth = 32);
+
+//relative norm of the dielectric profile spectrum which is dropped by the banded Poisson solver (maximum of the profiles)
+double dielectric_band_truncation_error(const mat& diel, const uword bandwidth);
+
+//Poisson solver in 3D on the real space grid with the same inputs and output as poisson_solver_3D
+//conjugate gradient on the real space grid with the spectral operator of poisson_solver_3D, preconditioned by one V-cycle of the geometric multigrid
+//for the second order finite differences of div(eps * grad(V)) = -4PI * rho (red-black Gauss-Seidel smoothers, semi-coarsening along the fine normal grids)
+//the grids with odd sizes along the finest axes (no small coarsest level) are solved by the direct solver with a warning
+cube poisson_solver_multigrid(const cube& rho, mat diel, rowvec3 lengths, uword normal_direction);
+
+#ifdef FFTW_SINGLE
+//single precision Poisson solver for the half spectrum of the charge density (FFTs and the linear solves in float)
+fcube poisson_solver_3D(const cx_fcube& rhok, const SizeCube& rho_size, mat diel, rowvec3 lengths, uword normal_direction);
+#endif
+
+//the halved axis of the charge spectrum in the Poisson solver (an in-plane axis)
+inline uword poisson_half_axis(const uword normal_direction) noexcept {
+	return (normal_direction == 0) ? 1 : 0;
+}
 
 
 
-//generate a copy of the cube with the elements shifted by N positions along:
-//dim=0: each row
-//dim=1: each column
-//dim=2: each slice
+//generate a copy of the cube with the elements circularly shifted by Nx, Ny, Nz positions along the columns, rows and slices
+//all three shifts are done in one pass: each column is copied as (at most) two contiguous blocks to its shifted position
 template <typename T>
-Cube<T> shift(const Cube<T>& A, const sword& N, const uword& dim) {
+Cube<T> circshift(const Cube<T>& A, const sword Nx, const sword Ny, const sword Nz) {
 	Cube<T> B(arma::size(A));
-	const auto index_init = regspace<uvec>(0, A.n_elem - 1);
-	imat sub_shift = conv_to<imat>::from(ind2sub(arma::size(A), index_init));
-	const uword size = arma::size(A)(dim);
-	sub_shift.row(dim).for_each([&N, &size](sword& i) noexcept {
-		i += N;
-		while (i < 0) i += size;
-		i = i % size;
-	});
+	if (A.is_empty()) {
+		return B;
+	}
 
-	B(sub2ind(arma::size(A), conv_to<umat>::from(sub_shift))) = A(index_init);
+	const auto positive_shift = [](const sword N, const uword size) noexcept {
+		const sword s = N % static_cast<sword>(size);
+		return static_cast<uword>((s < 0) ? s + static_cast<sword>(size) : s);
+	};
+	const uword sx = positive_shift(Nx, A.n_rows);
+	const uword sy = positive_shift(Ny, A.n_cols);
+	const uword sz = positive_shift(Nz, A.n_slices);
+
+#pragma omp parallel for
+	for (uword k = 0; k < A.n_slices; ++k) {
+		const uword k_out = (k + sz) % A.n_slices;
+		for (uword j = 0; j < A.n_cols; ++j) {
+			const T* in = A.slice_colptr(k, j);
+			T* out = B.slice_colptr(k_out, (j + sy) % A.n_cols);
+			std::copy(in, in + A.n_rows - sx, out + sx);
+			std::copy(in + A.n_rows - sx, in + A.n_rows, out);
+		}
+	}
 
 	return B;
 }
@@ -124,12 +210,8 @@ Row<T> ifftshift(const Row<T> &A) {
 
 //Undo a fftshift
 template <typename T>
-Cube<T> ifftshift(Cube<T> A) {
-	for (uword i = 0; i < 3; ++i) {
-		A = shift(A, -1 * (arma::size(A)(i) / 2), i);
-	}
-
-	return A;
+Cube<T> ifftshift(const Cube<T>& A) {
+	return circshift(A, -static_cast<sword>(A.n_rows / 2), -static_cast<sword>(A.n_cols / 2), -static_cast<sword>(A.n_slices / 2));
 }
 
 //returns the size of a cube as a rowvec
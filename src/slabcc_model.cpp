@@ -4,6 +4,37 @@
 
 #include "slabcc_model.hpp"
 
+namespace {
+	//rotation matrix of the trivariate Gaussians: rotations around the x, y, and z axis
+	mat33 rotation_matrix(const rowvec3& rotation_angle) {
+		const mat33 rot_x = {
+			{1, 0, 0},
+			{0, cos(rotation_angle(0)), -sin(rotation_angle(0))},
+			{0, sin(rotation_angle(0)), cos(rotation_angle(0))}
+		};
+
+		const mat33 rot_y = {
+			{ cos(rotation_angle(1)), 0, sin(rotation_angle(1))},
+			{0, 1, 0},
+			{-sin(rotation_angle(1)), 0, cos(rotation_angle(1))}
+		};
+
+		const mat33 rot_z = {
+			{cos(rotation_angle(2)), -sin(rotation_angle(2)), 0},
+			{sin(rotation_angle(2)), cos(rotation_angle(2)), 0},
+			{0, 0, 1}
+		};
+
+		return rot_x * rot_y * rot_z;
+	}
+
+	//a wave vector component and its (weighted) 1D factor of the Gaussian spectrum
+	struct wave_factor {
+		double G;
+		cx_double factor;
+	};
+}
+
 
 void slabcc_model::set_input_variables(const input_data& inputfile_variables) {
 	normal_direction = inputfile_variables.normal_direction;
@@ -16,6 +47,9 @@ void slabcc_model::set_input_variables(const input_data& inputfile_variables) {
 	charge_rotations = inputfile_variables.charge_rotations;
 	charge_fraction = inputfile_variables.charge_fraction;
 	trivariate_charge = inputfile_variables.trivariate;
+	fourier_interpolation = inputfile_variables.interpolation == "fourier";
+	reciprocal_charge = inputfile_variables.charge_reciprocal;
+	single_precision_optimization = inputfile_variables.optimize_single_precision;
 	set_model_type(inputfile_variables.model_2D, diel_in, diel_out);
 };
 
@@ -109,88 +143,128 @@ void slabcc_model::dielectric_profiles_gen() {
 void slabcc_model::gaussian_charges_gen() {
 
 	do {
-		rowvec x0 = linspace<rowvec>(0, cell_vectors_lengths(0) - cell_vectors_lengths(0) / cell_grid(0), cell_grid(0));
-		rowvec y0 = linspace<rowvec>(0, cell_vectors_lengths(1) - cell_vectors_lengths(1) / cell_grid(1), cell_grid(1));
-		rowvec z0 = linspace<rowvec>(0, cell_vectors_lengths(2) - cell_vectors_lengths(2) / cell_grid(2), cell_grid(2));
-
-		CHG = arma::zeros<cx_cube>(as_size(cell_grid));
-
-		for (uword i = 0; i < charge_fraction.n_elem; ++i) {
-			// shift the axis reference to position of the Gaussian charge center
-			rowvec x = x0 - accu(cell_vectors.col(0) * charge_position(i, 0));
-			rowvec y = y0 - accu(cell_vectors.col(1) * charge_position(i, 1));
-			rowvec z = z0 - accu(cell_vectors.col(2) * charge_position(i, 2));
-			//handle the minimum distance from the mirror charges
-			for (auto& pos : x) {
-				if (abs(pos) > cell_vectors_lengths(0) / 2) {
-					pos = cell_vectors_lengths(0) - abs(pos);
-				}
-			}
-			for (auto& pos : y) {
-				if (abs(pos) > cell_vectors_lengths(1) / 2) {
-					pos = cell_vectors_lengths(1) - abs(pos);
-				}
-			}
-			for (auto& pos : z) {
-				if (abs(pos) > cell_vectors_lengths(2) / 2) {
-					pos = cell_vectors_lengths(2) - abs(pos);
-				}
+		if (reciprocal_charge) {
+			gaussian_charges_spectrum_gen();
+			total_charge = real(CHG_k(0, 0, 0)) * voxel_vol;
+			//the optimizer only needs the spectrum
+			if (!in_optimization) {
+				CHG = ifft_c2r(CHG_k, as_size(cell_grid), poisson_half_axis(normal_direction));
 			}
+		}
+		else {
+			gaussian_charges_real_space_gen();
+			total_charge = accu(CHG) * voxel_vol;
+		}
+	}while(had_discretization_error());
+	update_V_target();
+}
 
-			cube xs, ys, zs;
-			tie(xs, ys, zs) = ndgrid(x, y, z);
-
-			const rowvec3 rotation_angle = charge_rotations.row(i);
-			//rotate around xyz axis
-			if (max(abs(rotation_angle)) > 0.002) {
-				const mat33 rot_x = {
-					{1, 0, 0},
-					{0, cos(rotation_angle(0)), -sin(rotation_angle(0))},
-					{0, sin(rotation_angle(0)), cos(rotation_angle(0))}
-				};
-
-				const mat33 rot_y = {
-					{ cos(rotation_angle(1)), 0, sin(rotation_angle(1))},
-					{0, 1, 0},
-					{-sin(rotation_angle(1)), 0, cos(rotation_angle(1))}
-				};
-
-				const mat33 rot_z = {
-					{cos(rotation_angle(2)), -sin(rotation_angle(2)), 0},
-					{sin(rotation_angle(2)), cos(rotation_angle(2)), 0},
-					{0, 0, 1}
-				};
-
-				const mat33 rotation_mat = rot_x * rot_y * rot_z;
-				for (uword i = 0; i < xs.n_elem; ++i) {
-					const vec3 old_coordinates = { xs(i), ys(i), zs(i) };
-					const vec3 new_coordinates = rotation_mat * old_coordinates;
-					xs(i) = new_coordinates(0);
-					ys(i) = new_coordinates(1);
-					zs(i) = new_coordinates(2);
-				}
-			}
+void slabcc_model::gaussian_charges_real_space_gen() {
+	rowvec x0 = linspace<rowvec>(0, cell_vectors_lengths(0) - cell_vectors_lengths(0) / cell_grid(0), cell_grid(0));
+	rowvec y0 = linspace<rowvec>(0, cell_vectors_lengths(1) - cell_vectors_lengths(1) / cell_grid(1), cell_grid(1));
+	rowvec z0 = linspace<rowvec>(0, cell_vectors_lengths(2) - cell_vectors_lengths(2) / cell_grid(2), cell_grid(2));
+
+	CHG = arma::zeros<cube>(as_size(cell_grid));
 
-			const cube r2 = square(xs) + square(ys) + square(zs);
+	for (uword i = 0; i < charge_fraction.n_elem; ++i) {
+		// shift the axis reference to position of the Gaussian charge center
+		rowvec x = x0 - accu(cell_vectors.col(0) * charge_position(i, 0));
+		rowvec y = y0 - accu(cell_vectors.col(1) * charge_position(i, 1));
+		rowvec z = z0 - accu(cell_vectors.col(2) * charge_position(i, 2));
+		//handle the minimum distance from the mirror charges (the sign is kept for the rotated Gaussians)
+		x -= cell_vectors_lengths(0) * round(x / cell_vectors_lengths(0));
+		y -= cell_vectors_lengths(1) * round(y / cell_vectors_lengths(1));
+		z -= cell_vectors_lengths(2) * round(z / cell_vectors_lengths(2));
+
+		// this charge distribution is due to the 1st nearest gaussian image. 
+		// In case of the very small supercells or very diffuse charges (large sigma), the higher order of the image charges must also be included.
+		// But the validity of the correction method for these cases must be checked!	
+
+		const double Q = charge_fraction(i) * defect_charge;
+		const rowvec3 sigma = trivariate_charge ? rowvec3(charge_sigma.row(i)) : rowvec3{ charge_sigma(i, 0), charge_sigma(i, 0), charge_sigma(i, 0) };
+		const rowvec3 rotation_angle = charge_rotations.row(i);
+		//rotate around xyz axis
+		if (trivariate_charge && max(abs(rotation_angle)) > 0.002) {
+			const mat33 rotation_mat = rotation_matrix(rotation_angle);
+			//the exponent of the Gaussian in the rotated frame: r^T R^T D^-1 R r / 2, with D = diag(sigma^2)
+			const mat33 inv_covariance = rotation_mat.t() * diagmat(1 / square(sigma)) * rotation_mat;
+			add_gaussian(CHG, x, y, z, inv_covariance, Q / (pow(2 * PI, 1.5) * prod(sigma)));
+		}
+		else {
+			//axis-aligned Gaussians are the outer product of the 1D Gaussians along each axis (spherical ones are invariant under the rotation)
+			const rowvec gauss_x = exp(-square(x) / (2 * square(sigma(0))));
+			const rowvec gauss_y = exp(-square(y) / (2 * square(sigma(1))));
+			const rowvec gauss_z = Q / (pow(2 * PI, 1.5) * prod(sigma)) * exp(-square(z) / (2 * square(sigma(2))));
+			add_outer_product(CHG, gauss_x, gauss_y, gauss_z);
+		}
+	}
+}
 
-			// this charge distribution is due to the 1st nearest gaussian image. 
-			// In case of the very small supercells or very diffuse charges (large sigma), the higher order of the image charges must also be included.
-			// But the validity of the correction method for these cases must be checked!	
+void slabcc_model::gaussian_charges_spectrum_gen() {
+	const uword half_axis = poisson_half_axis(normal_direction);
+	CHG_k = arma::zeros<cx_cube>((half_axis == 0) ? cell_grid(0) / 2 + 1 : cell_grid(0), (half_axis == 1) ? cell_grid(1) / 2 + 1 : cell_grid(1), cell_grid(2));
+	const urowvec3 spectrum_size = { CHG_k.n_rows, CHG_k.n_cols, CHG_k.n_slices };
+	spectrum_truncation = 0;
 
-			const double Q = charge_fraction(i) * defect_charge;
-			if (trivariate_charge) {
-				CHG += cx_cube(Q / (pow(2 * PI, 1.5) * prod(charge_sigma.row(i)))
-					* exp(-square(xs) / (2 * square(charge_sigma(i, 0))) - square(ys) / (2 * square(charge_sigma(i, 1))) - square(zs) / (2 * square(charge_sigma(i, 2))))
-					, arma::zeros(as_size(cell_grid)));
-			}
-			else {
-				CHG += cx_cube(Q / pow((charge_sigma(i, 0) * sqrt(2 * PI)), 3) * exp(-r2 / (2 * square(charge_sigma(i, 0)))), arma::zeros(as_size(cell_grid)));
+	for (uword i = 0; i < charge_fraction.n_elem; ++i) {
+		const rowvec3 sigma = trivariate_charge ? rowvec3(charge_sigma.row(i)) : rowvec3{ charge_sigma(i, 0), charge_sigma(i, 0), charge_sigma(i, 0) };
+		const rowvec3 rotation_angle = charge_rotations.row(i);
+		const bool rotated = trivariate_charge && max(abs(rotation_angle)) > 0.002;
+		const mat33 rotation_mat = rotated ? rotation_matrix(rotation_angle) : mat33(fill::eye);
+		//covariance matrix of the Gaussian
+		const mat33 covariance = rotation_mat.t() * diagmat(square(sigma)) * rotation_mat;
+
+		//the spectrum is cut at the Nyquist wave vectors of the grid: |rhok| = Q * exp(-G^T covariance G / 2)
+		//its largest value on the plane G(axis) = G_nyquist is at G^T covariance G = G_nyquist^2 / inv(covariance)(axis, axis)
+		const mat33 inv_covariance = inv_sympd(covariance);
+		for (uword axis = 0; axis < 3; ++axis) {
+			const double G_nyquist = (cell_grid(axis) / 2) * 2.0 * PI / cell_vectors_lengths(axis);
+			spectrum_truncation = std::max(spectrum_truncation, abs(charge_fraction(i) * defect_charge) * exp(-square(G_nyquist) / (2 * inv_covariance(axis, axis))));
+		}
+
+		//FFT of the Gaussian with all its periodic images: Q/voxel_vol * exp(-i G.r0 - G^T covariance G / 2)
+		//the diagonal terms are separable and are calculated for each axis
+		//the Nyquist component of the even grids is the average of its +/- frequencies (as for a real charge density)
+		array<vector<vector<wave_factor>>, 3> waves;
+		for (uword axis = 0; axis < 3; ++axis) {
+			const uword n = cell_grid(axis);
+			const double Gs = 2.0 * PI / cell_vectors_lengths(axis);
+			const double r0 = accu(cell_vectors.col(axis) * charge_position(i, axis));
+			waves[axis].resize(spectrum_size(axis));
+			for (uword m = 0; m < spectrum_size(axis); ++m) {
+				const double G = ((m < (n + 1) / 2) ? static_cast<double>(m) : static_cast<double>(m) - n) * Gs;
+				const bool nyquist = (n % 2 == 0) && (m == n / 2);
+				for (const double G_m : nyquist ? vector<double>{ G, -G } : vector<double>{ G }) {
+					const cx_double factor = exp(cx_double(-covariance(axis, axis) * G_m * G_m / 2, -G_m * r0));
+					waves[axis][m].push_back({ G_m, nyquist ? factor / 2.0 : factor });
+				}
 			}
 		}
 
-		total_charge = accu(real(CHG)) * voxel_vol;
-	}while(had_discretization_error());
-	update_V_target();
+		const double Q = charge_fraction(i) * defect_charge / voxel_vol;
+#pragma omp parallel for
+		for (uword k = 0; k < CHG_k.n_slices; ++k) {
+			for (uword j = 0; j < CHG_k.n_cols; ++j) {
+				for (uword l = 0; l < CHG_k.n_rows; ++l) {
+					cx_double rhok = 0;
+					for (const auto& z : waves[2][k]) {
+						for (const auto& y : waves[1][j]) {
+							const cx_double yz = y.factor * z.factor;
+							for (const auto& x : waves[0][l]) {
+								if (rotated) {
+									rhok += x.factor * yz * exp(-covariance(0, 1) * x.G * y.G - covariance(0, 2) * x.G * z.G - covariance(1, 2) * y.G * z.G);
+								}
+								else {
+									rhok += x.factor * yz;
+								}
+							}
+						}
+					}
+					CHG_k(l, j, k) += Q * rhok;
+				}
+			}
+		}
+	}
 }
 
 tuple<vector<double>, vector<double>, vector<double>, vector<double>> slabcc_model::data_packer(opt_switches optimize) const {
@@ -372,17 +446,18 @@ bool slabcc_model::had_discretization_error() {
 
 	auto log = spdlog::get("loggers");
 	const double tolerance = 1e-4; //minimum significant discretization error
-	const double new_charge_error = abs(defect_charge - total_charge);
+	//the total charge of the reciprocal space model is always exact: the truncation of its spectrum is checked instead
+	const double new_charge_error = reciprocal_charge ? spectrum_truncation : abs(defect_charge - total_charge);
 	if ((last_charge_error > tolerance) && (new_charge_error > last_charge_error)) { 
 		//increasing the grid size is not helping
 		log->debug("Model charge error on the new grid size: {}", new_charge_error);
 		log->critical("Increasing the calculation grid size did not decrease the discretization error. Most probably the model charge is fairly delocalized!");
 
 		if (is_active(verbosity::write_planarAvg_file)) {
-			write_planar_avg(real(POT) * Hartree_to_eV, real(CHG) * voxel_vol, "M",  cell_vectors_lengths);
+			write_planar_avg(POT * Hartree_to_eV, CHG * voxel_vol, "M",  cell_vectors_lengths);
 		}
 		else if (is_active(verbosity::write_normal_planarAvg)) {
-			write_planar_avg(real(POT) * Hartree_to_eV, real(CHG) * voxel_vol, "M", cell_vectors_lengths, normal_direction);
+			write_planar_avg(POT * Hartree_to_eV, CHG * voxel_vol, "M", cell_vectors_lengths, normal_direction);
 		}
 
 		finalize_loggers();
@@ -408,12 +483,16 @@ bool slabcc_model::had_discretization_error() {
 void slabcc_model::update_V_target() {
 	auto log = spdlog::get("loggers");
 	if (as_size(cell_grid) != arma::size(POT_target)) {
-		POT_target.set_size(as_size(cell_grid));
-		const rowvec new_grid_x = linspace<rowvec>(1.0, POT_target_on_input_grid.n_rows, cell_grid(0));
-		const rowvec new_grid_y = linspace<rowvec>(1.0, POT_target_on_input_grid.n_cols, cell_grid(1));
-		const rowvec new_grid_z = linspace<rowvec>(1.0, POT_target_on_input_grid.n_slices, cell_grid(2));
+		if (fourier_interpolation) {
+			POT_target = fourier_interp3(POT_target_on_input_grid, as_size(cell_grid));
+		}
+		else {
+			const rowvec new_grid_x = linspace<rowvec>(1.0, POT_target_on_input_grid.n_rows, cell_grid(0));
+			const rowvec new_grid_y = linspace<rowvec>(1.0, POT_target_on_input_grid.n_cols, cell_grid(1));
+			const rowvec new_grid_z = linspace<rowvec>(1.0, POT_target_on_input_grid.n_slices, cell_grid(2));
 
-		POT_target = interp3(POT_target_on_input_grid, new_grid_x, new_grid_y, new_grid_z);
+			POT_target = interp3(POT_target_on_input_grid, new_grid_x, new_grid_y, new_grid_z);
+		}
 		POT_target -= accu(POT_target) / POT_target.n_elem;
 		log->debug("New potential grid size: " + to_string(SizeVec(POT_target)));
 	}
@@ -468,9 +547,9 @@ tuple <rowvec, rowvec> slabcc_model::extrapolate(int extrapol_steps_num, double
 		dielectric_profiles_gen();
 
 		// (only works for the orthogonal cells!)
-		const auto CHG_normalized = CHG - total_charge / prod(cell_vectors_lengths);
+		const cube CHG_normalized = CHG - total_charge / prod(cell_vectors_lengths);
 		const auto V = poisson_solver_3D(CHG_normalized, dielectric_profiles, cell_vectors_lengths, normal_direction);
-		const auto EperModel = 0.5 * accu(real(V % CHG_normalized)) * voxel_vol * Hartree_to_eV;
+		const auto EperModel = 0.5 * accu(V % CHG_normalized) * voxel_vol * Hartree_to_eV;
 		const rowvec2 interface_pos = interfaces * cell_vectors_lengths(normal_direction);
 		string extrapolation_info = to_string(extrapol_factor) + "\t" + ::to_string(EperModel) + "\t" + ::to_string(total_charge) + "\t" + to_string(interface_pos);
 		for (uword i = 0; i < charge_position.n_rows; ++i) {
@@ -574,11 +653,21 @@ double slabcc_model::potential_error(const vector<double>& x, vector<double>& gr
 	gaussian_charges_gen();
 	dielectric_profiles_gen();
 
-	POT = poisson_solver_3D(CHG, dielectric_profiles, cell_vectors_lengths, normal_direction);
-	POT_diff = real(POT) * Hartree_to_eV - POT_target;
 	//bigger output for out-of-bounds input: quadratic penalty
 	const double bounds_correction = bounds_factor + 10 * bounds_factor * bounds_factor;
-	potential_RMSE = sqrt(accu(square(POT_diff)) /POT_diff.n_elem) + bounds_correction;
+	if (in_optimization && single_precision_optimization) {
+		potential_RMSE = single_precision_RMSE() + bounds_correction;
+	}
+	else {
+		if (reciprocal_charge) {
+			POT = poisson_solver_3D(CHG_k, as_size(cell_grid), dielectric_profiles, cell_vectors_lengths, normal_direction);
+		}
+		else {
+			POT = poisson_solver_3D(CHG, dielectric_profiles, cell_vectors_lengths, normal_direction);
+		}
+		POT_diff = POT * Hartree_to_eV - POT_target;
+		potential_RMSE = sqrt(accu(square(POT_diff)) / POT_diff.n_elem) + bounds_correction;
+	}
 
 	if (initial_potential_RMSE < 0) {
 		initial_potential_RMSE = potential_RMSE;
@@ -616,6 +705,24 @@ double slabcc_model::potential_error(const vector<double>& x, vector<double>& gr
 	return potential_RMSE;
 }
 
+double slabcc_model::single_precision_RMSE() const {
+#ifdef FFTW_SINGLE
+	const cx_fcube rhok = reciprocal_charge ? conv_to<cx_fcube>::from(CHG_k) : fft_r2c(conv_to<fcube>::from(CHG), poisson_half_axis(normal_direction));
+	const fcube POT_single = poisson_solver_3D(rhok, as_size(cell_grid), dielectric_profiles, cell_vectors_lengths, normal_direction);
+	double squared_error = 0;
+	for (uword i = 0; i < POT_single.n_elem; ++i) {
+		squared_error += square(POT_single(i) * Hartree_to_eV - POT_target(i));
+	}
+
+	return sqrt(squared_error / POT_single.n_elem);
+#else
+	auto log = spdlog::get("loggers");
+	log->critical("Support for the single precision FFTs is not enabled in this build (-DFFTW_FLOAT)!");
+	finalize_loggers();
+	exit(1);
+#endif
+}
+
 void slabcc_model::optimize(const string& opt_algo, const double& opt_tol, const int& max_eval, const int& max_time, const opt_switches& optimize) {
 
 	auto log = spdlog::get("loggers");
@@ -686,12 +793,10 @@ void slabcc_model::check_V_error() {
 		}
 	}
 
-	const auto V_error_x = planar_average(0, POT_diff);
-	const auto V_error_y = planar_average(1, POT_diff);
-	const auto V_error_z = planar_average(2, POT_diff);
+	const auto V_errors = planar_sums({ &POT_diff }).front();
 
 	//potential error in each direction
-	rowvec3 V_error_planars = { accu(square(V_error_x)), accu(square(V_error_y)), accu(square(V_error_z)) };
+	rowvec3 V_error_planars = { accu(square(V_errors.at(0))), accu(square(V_errors.at(1))), accu(square(V_errors.at(2))) };
 	V_error_planars = sqrt(V_error_planars / POT_diff.n_elem);
 	log->debug("Directional RMSE: " + to_string(V_error_planars));
 	if (max(V_error_planars) / min(V_error_planars) > 10) {
@@ -716,8 +821,8 @@ void slabcc_model::verify_CHG(const cube& defect_charge) {
 		vector<span> spans = { span(), span(), span(interfaces_grid_i(0),interfaces_grid_i(1)) };
 		swap(spans[normal_direction], spans[2]);
 
-		const double model_total = accu(real(CHG)) * voxel_vol;
-		const double model_in = accu(real(CHG(spans[0], spans[1], spans[2]))) * voxel_vol;
+		const double model_total = accu(CHG) * voxel_vol;
+		const double model_in = accu(CHG(spans[0], spans[1], spans[2])) * voxel_vol;
 		const double model_out = model_total - model_in;
 
 		//The original defect may have a different grid size than the final model!
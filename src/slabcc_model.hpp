@@ -49,15 +49,22 @@ struct slabcc_model {
 	double total_charge = 0;		// total charge in CHG
 	double defect_charge = 0;		// difference in the charge of the input files
 	bool trivariate_charge = false;
+	bool fourier_interpolation = false;	// resample the target potential by Fourier interpolation instead of the cubic splines
+	bool reciprocal_charge = false;		// generate the Gaussian charges analytically in the reciprocal space
+	bool single_precision_optimization = false;	// evaluate the potential RMSE in single precision during the optimization
 	double last_charge_error = 0;		// error in the total charge of the model in the last check
+	double spectrum_truncation = 0;		// largest magnitude of the model charge spectrum at the Nyquist wave vectors (only with reciprocal_charge)
 
 	//calculated data
 	double potential_RMSE = 0;
 	double initial_potential_RMSE = -1;
-	cx_cube CHG; // model charge distribution (e/bohr^3), negative for presence of the electron 
+	cube CHG; // model charge distribution (e/bohr^3), negative for presence of the electron 
+
+	//half spectrum of the model charge distribution as fft_r2c(CHG, poisson_half_axis(normal_direction)) (only with reciprocal_charge)
+	cx_cube CHG_k;
 
 	//potential resulted from the model charge (Hartree)
-	cx_cube POT;
+	cube POT;
 
 	//difference of the potential resulted from the model charge (POT) and the target potential from QM calculations (POT_target)  (eV)
 	cube POT_diff;
@@ -94,10 +101,17 @@ struct slabcc_model {
 	// dielectric tensor elements' variation in the normal direction.
 	void dielectric_profiles_gen();
 
-	// produces Gaussian charge distribution in real space
+	// produces Gaussian charge distribution (CHG, and CHG_k for reciprocal_charge)
 	// the generated charge distribution data is in (e/bohr^3)
+	// during the optimization, CHG is not updated for the reciprocal_charge
 	void gaussian_charges_gen();
 
+	// generates CHG from the nearest image of each Gaussian charge on the real space grid
+	void gaussian_charges_real_space_gen();
+
+	// generates CHG_k from the analytic Fourier transform of the Gaussian charges (including all of their periodic images)
+	void gaussian_charges_spectrum_gen();
+
 	//pack the optimization variable structure and their lower and upper boundaries into std::vector<double> for NLOPT
 	//returned vectors are "optimization parameters", "lower boundaries", "upper boundaries"
 	tuple<vector<double>, vector<double>, vector<double>, vector<double>> data_packer(opt_switches optimize = opt_switches{ false,false,false,false,false }) const;
@@ -135,6 +149,9 @@ struct slabcc_model {
 	//returns: root mean squared error (RMSE) of the model charge potential 
 	double potential_error(const vector<double>& x, vector<double>& grad);
 
+	//RMSE of the model charge potential calculated by the single precision FFTs and solvers (POT and POT_diff are not updated)
+	double single_precision_RMSE() const;
+
 	//checks the potential_RMSE and its directional values
 	void check_V_error();
 
@@ -4,6 +4,10 @@
 
 #include "vasp.hpp"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 void supercell::write_POSCAR(const string& file_name) const{
 	ofstream out_file;
 	out_file.open(file_name);
@@ -93,15 +97,45 @@ void supercell::shift(const rowvec3& relative_shift) {
 
 }
 
+namespace {
+	string read_decompressed_head(const string& file_name, string& error);
+}
+
 supercell::supercell(const string& file_name) {
 	auto log = spdlog::get("loggers");
+	if (is_HDF5_file(file_name)) {
+		read_HDF5(file_name);
+		return;
+	}
+
+	if (detect_compression(file_name) != compression::none) {
+		string error;
+		const string head = read_decompressed_head(file_name, error);
+		if (!error.empty()) {
+			log->critical(error);
+		}
+		memory_buffer buffer(head.data(), head.data() + head.size());
+		istream infile(&buffer);
+		read_POSCAR(infile, file_name);
+		return;
+	}
+
 	ifstream infile;
-	string temp_line;
 	infile.open(file_name);
 	if (!infile) {
 		log->critical("Could not open the "+ file_name);
 	}
 	// TODO: if file is unreadable, message!
+	read_POSCAR(infile, file_name);
+}
+
+supercell::supercell(istream& infile, const string& file_name) {
+	read_POSCAR(infile, file_name);
+}
+
+void supercell::read_POSCAR(istream& infile, const string& file_name) {
+	auto log = spdlog::get("loggers");
+	string temp_line;
 	getline(infile, label);
 	getline(infile, temp_line);
 	scaling = stod(temp_line);
@@ -171,36 +205,565 @@ supercell::supercell(const string& file_name) {
 	normalize_positions();
 }
 
-cube read_VASP_grid_data(const string& file_name) {
+namespace {
+	inline bool is_blank(const char c) noexcept {
+		return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f');
+	}
+
+	//number of the whitespace-separated tokens in [begin end)
+	uword count_tokens(const char* begin, const char* end) noexcept {
+		uword tokens = 0;
+		bool in_token = false;
+		for (const char* p = begin; p != end; ++p) {
+			const bool space = is_blank(*p) || (*p == '\n');
+			tokens += (!space && !in_token);
+			in_token = !space;
+		}
+		return tokens;
+	}
+
+	//reads a line with exactly 3 positive integers (grid size of a dataset) and moves the pos to the next line
+	bool read_grid_line(const char*& pos, const char* end, urowvec3& grid) {
+		const char* line_end = find(pos, end, '\n');
+		const char* p = pos;
+		uword values = 0;
+		while (p != line_end) {
+			while ((p != line_end) && is_blank(*p)) ++p;
+			if (p == line_end) break;
+			uword value = 0;
+			const char* const token_start = p;
+			while ((p != line_end) && (*p >= '0') && (*p <= '9')) {
+				value = value * 10 + (*p - '0');
+				++p;
+			}
+			if ((p == token_start) || ((p != line_end) && !is_blank(*p)) || (values == 3) || (value == 0)) {
+				return false;
+			}
+			grid(values++) = value;
+		}
+		if (values != 3) {
+			return false;
+		}
+		pos = (line_end == end) ? end : line_end + 1;
+		return true;
+	}
+
+	//moves the pos after the "count" tokens and to the start of the next line
+	bool skip_tokens(const char*& pos, const char* end, const uword count) noexcept {
+		uword skipped = 0;
+		const char* p = pos;
+		while (skipped < count) {
+			while ((p != end) && (is_blank(*p) || (*p == '\n'))) ++p;
+			if (p == end) return false;
+			while ((p != end) && !is_blank(*p) && (*p != '\n')) ++p;
+			++skipped;
+		}
+		p = find(p, end, '\n');
+		pos = (p == end) ? end : p + 1;
+		return true;
+	}
+
+	//finds the end of "count" values written in lines with fixed length, starting at the "begin"
+	//returns nullptr if the lines are not uniform
+	const char* predict_data_end(const char* begin, const char* end, const uword count, uword& values_per_line, size_t& line_length_out, size_t& field_width_out) noexcept {
+		const char* const first_line_end = find(begin, end, '\n');
+		if (first_line_end == end) return nullptr;
+		const uword per_line = count_tokens(begin, first_line_end);
+		if ((per_line == 0) || (per_line > count)) return nullptr;
+		const size_t newline_size = ((first_line_end != begin) && (*(first_line_end - 1) == '\r')) ? 2 : 1;
+		const size_t line_length = first_line_end + 1 - begin;
+		const size_t content_length = line_length - newline_size;
+		if (content_length % per_line != 0) return nullptr;
+		const size_t field_width = content_length / per_line;
+		const uword full_lines = count / per_line;
+		const uword remaining = count % per_line;
+		const size_t last_line_length = (remaining == 0) ? line_length : remaining * field_width + newline_size;
+		const size_t data_length = (full_lines - (remaining == 0)) * line_length + last_line_length;
+		if (data_length > static_cast<size_t>(end - begin)) return nullptr;
+
+		//the last line must be a complete line with the expected number of values
+		const char* const data_end = begin + data_length;
+		const char* const last_line = data_end - last_line_length;
+		if ((*(data_end - 1) != '\n') || ((last_line != begin) && (*(last_line - 1) != '\n'))) return nullptr;
+		if (count_tokens(last_line, data_end) != ((remaining == 0) ? per_line : remaining)) return nullptr;
+
+		values_per_line = per_line;
+		line_length_out = line_length;
+		field_width_out = field_width;
+		return data_end;
+	}
+
+	//decompresses a file until the end of the grid size line of its 1st dataset (a blank line followed by 3 positive integers)
+	//or until the end of the file if there is no grid data
+	string read_decompressed_head(const string& file_name, string& error) {
+		decompressed_stream stream(file_name, 1 << 16);
+		string head;
+		vector<char> block;
+		size_t line_start = 0;
+		bool previous_blank = false;
+		while (stream.next_block(block)) {
+			head.append(block.data(), block.size());
+			size_t line_end = 0;
+			while ((line_end = head.find('\n', line_start)) != string::npos) {
+				const char* pos = head.data() + line_start;
+				urowvec3 grid;
+				if (previous_blank && read_grid_line(pos, head.data() + line_end + 1, grid)) {
+					head.resize(line_end + 1);
+					return head;
+				}
+				previous_blank = all_of(head.data() + line_start, head.data() + line_end, is_blank);
+				line_start = line_end + 1;
+			}
+		}
+		error = stream.error_message();
+		return head;
+	}
+
+	//parses "count" values from the decompressed data, starting at the "offset"
+	//each block is parsed while the next ones are being decompressed
+	uword parse_decompressed(decompressed_stream& stream, const size_t offset, double* values, const uword count) {
+		vector<char> block, text;
+		size_t position = 0;
+		uword values_read = 0;
+		bool last_block = false;
+		while ((values_read < count) && !last_block) {
+			last_block = !stream.next_block(block);
+			if (!last_block) {
+				const size_t skip = std::min(block.size(), offset - std::min(offset, position));
+				position += block.size();
+				text.insert(text.end(), block.begin() + skip, block.end());
+			}
+
+			//the last token may continue in the next block
+			size_t complete = text.size();
+			while (!last_block && (complete != 0) && !is_blank(text[complete - 1]) && (text[complete - 1] != '\n')) --complete;
+			const uword expected = std::min(count_tokens(text.data(), text.data() + complete), count - values_read);
+			const uword parsed = parse_doubles(text.data(), text.data() + complete, values + values_read, expected);
+			values_read += parsed;
+			if (parsed != expected) {
+				break;
+			}
+			text.erase(text.begin(), text.begin() + complete);
+		}
+		return values_read;
+	}
+
+	const string cache_suffix = ".slabcc_cache";
+	const char cache_magic[8] = { 'S', 'L', 'A', 'B', 'C', 'C', 'G', 'C' };
+	const uint64_t cache_version = 1;
+	const uint64_t cache_byte_order = 0x0102030405060708;
+	const size_t cache_alignment = 64;
+
+	//layout of the cache file: header, full path of the source, POSCAR part of the source, padding, grid data
+	struct cache_header {
+		char magic[8];
+		uint64_t version;
+		uint64_t byte_order;
+		uint64_t source_size;
+		int64_t source_modification_time;
+		uint64_t path_size;
+		uint64_t structure_size;
+		uint64_t grid[3];
+		uint64_t data_offset;		//aligned to cache_alignment
+	};
+}
+
+VASP_grid_file::VASP_grid_file(const string& file_name, const bool use_cache, const string& type) : file_name(file_name), use_cache(use_cache), source_status(file_name) {
 	auto log = spdlog::get("loggers");
-	ifstream infile;
-	string temp_line;
-	infile.open(file_name);
-	if (!infile) {
-		log->critical("File not found: " + file_name);
-		return {};
+	if (is_HDF5_file(file_name)) {
+		log->trace("Started indexing the HDF5 file " + file_name);
+		HDF5_dataset = (type == "LOCPOT") ? "results/potential/total" : "charge/charge";
+		structure = supercell(file_name);
+		for (const auto& grid : read_HDF5_grid_sizes(file_name, HDF5_dataset)) {
+			dataset current;
+			current.grid = grid;
+			datasets.push_back(current);
+		}
+		if (datasets.empty()) {
+			log->error("No grid data could be found in {}:{}", file_name, HDF5_dataset);
+		}
+		return;
+	}
+
+	if (use_cache && source_status.exists && read_cache()) {
+		log->debug("Using the cache file of " + file_name);
+		return;
 	}
-	const supercell structure(file_name);
-	for (uword currLineNumber = 0; currLineNumber < 8 + structure.atoms_number; ++currLineNumber) {
-		if (infile.ignore(numeric_limits<streamsize>::max(), infile.widen('\n'))) {
-			//just skipping the line. POSCAR must be read and checked seperately
+
+	if (detect_compression(file_name) != compression::none) {
+		//only the head of the file is decompressed. The data is decompressed again while it is being parsed
+		log->trace("Started indexing the compressed file " + file_name);
+		string error;
+		compressed_head = read_decompressed_head(file_name, error);
+		if (!error.empty()) {
+			log->critical(error);
+			return;
+		}
+		const char* const head_end = compressed_head.data() + compressed_head.size();
+		if (!read_structure(compressed_head.data(), head_end)) {
+			return;
+		}
+		const char* pos = compressed_head.data() + structure_block.end;
+		while ((pos != head_end) && (is_blank(*pos) || (*pos == '\n'))) ++pos;
+		dataset current;
+		if (read_grid_line(pos, head_end, current.grid)) {
+			current.data.begin = pos - compressed_head.data();
+			datasets.push_back(current);
 		}
 		else {
-			log->error(file_name+ " could not be read properly");
-			return {};
+			log->error("No grid data could be found in " + file_name);
 		}
+		compressed = true;
+		return;
+	}
+
+	file = make_shared<const mapped_file>(file_name);
+	if (!file->is_open()) {
+		log->critical("File not found: " + file_name);
+		return;
+	}
+
+	log->trace("Started indexing " + file_name);
+	const char* const file_begin = file->begin();
+	const char* const file_end = file->end();
+	if (!read_structure(file_begin, file_end)) {
+		return;
+	}
+
+	const char* pos = file_begin + structure_block.end;
+	while (pos != file_end) {
+		//skip the empty lines, magnetic moments, etc. until the next grid size line
+		while ((pos != file_end) && (is_blank(*pos) || (*pos == '\n'))) ++pos;
+		const char* const line_start = pos;
+		dataset current;
+		if (!read_grid_line(pos, file_end, current.grid)) {
+			const char* const line_end = find(pos, file_end, '\n');
+			pos = (line_end == file_end) ? file_end : line_end + 1;
+			if (!datasets.empty() && (string(line_start, line_end).compare(0, 12, "augmentation") == 0)) {
+				//"augmentation occupancies ion_number values_number"
+				const char* last_token = line_end;
+				while ((last_token != line_start) && (is_blank(*(last_token - 1)))) --last_token;
+				while ((last_token != line_start) && !is_blank(*(last_token - 1))) --last_token;
+				const uword values_number = strtoul(last_token, nullptr, 10);
+				skip_tokens(pos, file_end, values_number);
+				datasets.back().augmentation.push_back({ static_cast<size_t>(line_start - file_begin), static_cast<size_t>(pos - file_begin) });
+			}
+			continue;
+		}
+
+		const uword values_number = prod(current.grid);
+		const char* data_end = predict_data_end(pos, file_end, values_number, current.values_per_line, current.line_length, current.field_width);
+		current.data.begin = pos - file_begin;
+		if (data_end == nullptr) {
+			log->trace("Grid data lines in {} are not uniform", file_name);
+			data_end = pos;
+			if (!skip_tokens(data_end, file_end, values_number)) {
+				log->error("Grid data in {} is incomplete", file_name);
+				data_end = file_end;
+			}
+		}
+		current.data.end = data_end - file_begin;
+		datasets.push_back(current);
+		pos = data_end;
+	}
+
+	if (datasets.empty()) {
+		log->error("No grid data could be found in " + file_name);
+	}
+	log->trace("{} dataset(s) found in {}", datasets.size(), file_name);
+}
+
+bool VASP_grid_file::read_structure(const char* begin, const char* end) {
+	memory_buffer buffer(begin, end);
+	istream infile(&buffer);
+	structure = supercell(infile, file_name);
+	const auto structure_end = infile.tellg();
+	if (structure_end < 0) {
+		auto log = spdlog::get("loggers");
+		log->error(file_name + " could not be read properly");
+		return false;
+	}
+	structure_block = { 0, static_cast<size_t>(structure_end) };
+	return true;
+}
+
+bool VASP_grid_file::is_open() const noexcept {
+	return compressed || !HDF5_dataset.empty() || (file && file->is_open());
+}
+
+cube VASP_grid_file::load_dataset(const uword index) const {
+	auto log = spdlog::get("loggers");
+	if (index >= datasets.size()) {
+		log->error("Dataset #{} could not be found in {}", index + 1, file_name);
+		return {};
+	}
+
+	if (!HDF5_dataset.empty()) {
+		return read_HDF5_grid(file_name, HDF5_dataset, index);
+	}
+
+	const dataset& data_set = datasets.at(index);
+	if (cached) {
+		//no copy: the pages of the cache file are shared until they are modified
+		double* const values = reinterpret_cast<double*>(file->data() + data_set.data.begin);
+		return cube(values, data_set.grid(0), data_set.grid(1), data_set.grid(2), false, false);
+	}
+
+	log->trace("Started reading " + file_name);
+	cube rawdata_cube(as_size(data_set.grid));
+	uword values_read = 0;
+	if (compressed) {
+		decompressed_stream stream(file_name);
+		values_read = parse_decompressed(stream, data_set.data.begin, rawdata_cube.memptr(), rawdata_cube.n_elem);
+		if (stream.failed()) {
+			log->error(stream.error_message());
+		}
+	}
+	else {
+		values_read = parse_doubles(file->begin() + data_set.data.begin, file->begin() + data_set.data.end, rawdata_cube.memptr(), rawdata_cube.n_elem);
+	}
+	if (values_read != rawdata_cube.n_elem) {
+		log->debug("Number of the grid data points read from {}: {}/{}", file_name, values_read, rawdata_cube.n_elem);
+		log->error(file_name + " could not be read properly");
+	}
+	else if (use_cache && (index == 0)) {
+		write_cache(rawdata_cube);
 	}
-	log->trace("Started reading "+ file_name);
-	getline(infile, temp_line);
-	urowvec3 grid;
-	infile >> grid;
-	cube rawdata_cube(as_size(grid));
-	infile >> rawdata_cube;
-	getline(infile, temp_line);
 
 	return rawdata_cube;
 }
 
+bool VASP_grid_file::read_cache() {
+	auto log = spdlog::get("loggers");
+	const string cache_file = file_name + cache_suffix;
+	const auto cache = make_shared<const mapped_file>(cache_file, true);
+	if (!cache->is_open()) {
+		log->trace("No cache file found for " + file_name);
+		return false;
+	}
+
+	cache_header header;
+	if (cache->size() < sizeof(header)) {
+		log->debug("The cache file {} is corrupted and will be replaced", cache_file);
+		return false;
+	}
+	memcpy(&header, cache->begin(), sizeof(header));
+	const uint64_t values_number = header.grid[0] * header.grid[1] * header.grid[2];
+	const size_t path_begin = sizeof(header);
+	const size_t structure_begin = path_begin + header.path_size;
+	const size_t structure_end = structure_begin + header.structure_size;
+	const bool valid_format = (memcmp(header.magic, cache_magic, sizeof(cache_magic)) == 0) &&
+		(header.version == cache_version) && (header.byte_order == cache_byte_order) &&
+		(header.data_offset % cache_alignment == 0) && (structure_end <= header.data_offset) &&
+		(values_number > 0) && (header.data_offset + values_number * sizeof(double) == cache->size());
+	if (!valid_format) {
+		log->debug("The cache file {} is corrupted or has an old format and will be replaced", cache_file);
+		return false;
+	}
+
+	const bool same_source = (header.source_size == source_status.size) &&
+		(header.source_modification_time == source_status.modification_time) &&
+		(string(cache->begin() + path_begin, header.path_size) == source_status.full_path);
+	if (!same_source) {
+		log->debug("The cache file {} is outdated and will be replaced", cache_file);
+		return false;
+	}
+
+	memory_buffer buffer(cache->begin() + structure_begin, cache->begin() + structure_end);
+	istream infile(&buffer);
+	structure = supercell(infile, file_name);
+	structure_block = { structure_begin, structure_end };
+
+	dataset data_set;
+	data_set.grid = { header.grid[0], header.grid[1], header.grid[2] };
+	data_set.data = { header.data_offset, header.data_offset + values_number * sizeof(double) };
+	datasets = { data_set };
+
+	file = cache;
+	cached = true;
+	return true;
+}
+
+void VASP_grid_file::write_cache(const cube& data) const {
+	auto log = spdlog::get("loggers");
+	const string cache_file = file_name + cache_suffix;
+
+	cache_header header;
+	memcpy(header.magic, cache_magic, sizeof(cache_magic));
+	header.version = cache_version;
+	header.byte_order = cache_byte_order;
+	header.source_size = source_status.size;
+	header.source_modification_time = source_status.modification_time;
+	header.path_size = source_status.full_path.size();
+	header.structure_size = structure_block.end - structure_block.begin;
+	header.grid[0] = data.n_rows;
+	header.grid[1] = data.n_cols;
+	header.grid[2] = data.n_slices;
+	const size_t structure_end = sizeof(header) + header.path_size + header.structure_size;
+	header.data_offset = (structure_end + cache_alignment - 1) / cache_alignment * cache_alignment;
+	const vector<char> padding(header.data_offset - structure_end, 0);
+
+	const bool written = write_file_atomically(cache_file, {
+		{ reinterpret_cast<const char*>(&header), sizeof(header) },
+		{ source_status.full_path.data(), header.path_size },
+		{ (compressed ? compressed_head.data() : file->begin()) + structure_block.begin, header.structure_size },
+		{ padding.data(), padding.size() },
+		{ reinterpret_cast<const char*>(data.memptr()), data.n_elem * sizeof(double) } });
+
+	if (written) {
+		log->debug("The cache file {} has been written", cache_file);
+	}
+	else {
+		log->warn("Could not write the cache file: " + cache_file);
+	}
+}
+
+uword VASP_grid_file::read_values(const uword index, const uword first, const uword count, double* values) const {
+	if (!is_seekable(index)) {
+		return 0;
+	}
+
+	const dataset& data_set = datasets.at(index);
+	const uword available = std::min(count, prod(data_set.grid) - std::min(first, prod(data_set.grid)));
+	if (cached) {
+		memcpy(values, file->begin() + data_set.data.begin + first * sizeof(double), available * sizeof(double));
+		return available;
+	}
+
+	const char* pos = file->begin() + data_set.data.begin + (first / data_set.values_per_line) * data_set.line_length + (first % data_set.values_per_line) * data_set.field_width;
+	const char* const end = file->begin() + data_set.data.end;
+	for (uword i = 0; i < available; ++i) {
+		while ((pos != end) && (is_blank(*pos) || (*pos == '\n'))) ++pos;
+		if (!parse_double(pos, end, values[i])) {
+			return i;
+		}
+	}
+	return available;
+}
+
+bool VASP_grid_file::is_seekable(const uword index) const noexcept {
+	//the 1st dataset of a file which is not cached yet, must be loaded as a whole to be written in the cache
+	if (use_cache && !cached && (index == 0)) {
+		return false;
+	}
+	//HDF5 grids are read in slices
+	if (!HDF5_dataset.empty()) {
+		return false;
+	}
+	return (index < datasets.size()) && (cached || (datasets.at(index).values_per_line != 0));
+}
+
+cube read_VASP_grid_difference(const VASP_grid_file& minuend, const VASP_grid_file& subtrahend, const rowvec3& relative_shift, const double scale) {
+	auto log = spdlog::get("loggers");
+	if (minuend.datasets.empty() || subtrahend.datasets.empty()) {
+		return {};
+	}
+	const urowvec3 grid = minuend.datasets.front().grid;
+	log->trace("Started reading the difference of {} and {}", minuend.file_name, subtrahend.file_name);
+
+	//the text files without fixed line length must be parsed as a whole
+	const cube minuend_data = minuend.is_seekable(0) ? cube() : minuend.load_dataset(0);
+	const cube subtrahend_data = subtrahend.is_seekable(0) ? cube() : subtrahend.load_dataset(0);
+
+	//destination of each point is shifted along each axis by the number of the grid points as in shift()
+	const rowvec3 shifts = round(conv_to<rowvec>::from(grid) % relative_shift);
+	urowvec3 offsets;
+	for (uword i = 0; i < 3; ++i) {
+		const sword shift_i = static_cast<sword>(shifts(i)) % static_cast<sword>(grid(i));
+		offsets(i) = (shift_i < 0) ? shift_i + grid(i) : shift_i;
+	}
+
+	cube difference(as_size(grid));
+	const uword chunk_size = grid(0) * 64;
+	const uword chunks_number = (difference.n_elem + chunk_size - 1) / chunk_size;
+	bool read_error = false;
+#pragma omp parallel
+	{
+		vector<double> minuend_buffer(chunk_size), subtrahend_buffer(chunk_size);
+#pragma omp for schedule(dynamic) reduction(||:read_error)
+		for (uword chunk = 0; chunk < chunks_number; ++chunk) {
+			const uword first = chunk * chunk_size;
+			const uword count = std::min(chunk_size, difference.n_elem - first);
+			const double* minuend_values = minuend_buffer.data();
+			const double* subtrahend_values = subtrahend_buffer.data();
+			if (minuend_data.is_empty()) {
+				read_error = read_error || (minuend.read_values(0, first, count, minuend_buffer.data()) != count);
+			}
+			else {
+				minuend_values = minuend_data.memptr() + first;
+			}
+			if (subtrahend_data.is_empty()) {
+				read_error = read_error || (subtrahend.read_values(0, first, count, subtrahend_buffer.data()) != count);
+			}
+			else {
+				subtrahend_values = subtrahend_data.memptr() + first;
+			}
+
+			//each chunk consists of complete rows (along the 1st axis)
+			for (uword row = 0; row < count / grid(0); ++row) {
+				const uword row_index = (first / grid(0)) + row;
+				const uword j = (row_index % grid(1) + offsets(1)) % grid(1);
+				const uword k = (row_index / grid(1) + offsets(2)) % grid(2);
+				double* const destination = difference.slice_colptr(k, j);
+				const uword source = row * grid(0);
+				for (uword i = 0; i < grid(0); ++i) {
+					destination[(i + offsets(0)) % grid(0)] = (minuend_values[source + i] - subtrahend_values[source + i]) * scale;
+				}
+			}
+		}
+	}
+
+	if (read_error) {
+		log->error("{} or {} could not be read properly", minuend.file_name, subtrahend.file_name);
+	}
+	return difference;
+}
+
+cube read_VASP_grid_data(const string& file_name) {
+	const VASP_grid_file grid_file(file_name);
+	return grid_file.load_dataset(0);
+}
+
+namespace {
+	//"+1.2345678901e+00 " and a newline after each 5 values, same as: ostream << showpos << scientific << setprecision(10)
+	//the values are formatted in parallel into the buffers of the blocks which are written in order
+	void write_grid_values(ostream& out_file, const cube& data) {
+		const uword values_per_line = 5;
+		const uword block_values = values_per_line * 8192;
+		const size_t max_value_length = 32;
+		const uword blocks_number = (data.n_elem + block_values - 1) / block_values;
+#ifdef _OPENMP
+		const uword batch_size = 2 * omp_get_max_threads();
+#else
+		const uword batch_size = 1;
+#endif
+		vector<vector<char>> buffers(std::min(batch_size, blocks_number), vector<char>(block_values * max_value_length + block_values / values_per_line));
+		vector<size_t> buffer_sizes(buffers.size());
+
+		for (uword batch_start = 0; batch_start < blocks_number; batch_start += batch_size) {
+			const uword batch_end = std::min(batch_start + batch_size, blocks_number);
+#pragma omp parallel for
+			for (uword block = batch_start; block < batch_end; ++block) {
+				char* const buffer = buffers.at(block - batch_start).data();
+				char* pos = buffer;
+				const uword first = block * block_values;
+				const uword last = std::min(first + block_values, data.n_elem);
+				for (uword i = first; i < last; ++i) {
+					pos += snprintf(pos, max_value_length, "%+.10e ", data(i));
+					if (i % values_per_line == values_per_line - 1) {
+						*pos++ = '\n';
+					}
+				}
+				buffer_sizes.at(block - batch_start) = pos - buffer;
+			}
+
+			for (uword block = batch_start; block < batch_end; ++block) {
+				out_file.write(buffers.at(block - batch_start).data(), buffer_sizes.at(block - batch_start));
+			}
+		}
+	}
+}
+
 void supercell::write_CHGPOT(const string& type, const string& file_name) const {
 	auto log = spdlog::get("loggers");
 	log->trace("Started writing " + file_name);
@@ -209,21 +772,9 @@ void supercell::write_CHGPOT(const string& type, const string& file_name) const
 	ofstream out_file;
 	out_file.open(file_name, ofstream::app);
 
-	cube CHGPOT;
-	if (type == "CHGCAR") {
-		CHGPOT = charge;
-	}
-	else if (type == "LOCPOT") {
-		CHGPOT = potential;
-	}
+	const cube& CHGPOT = (type == "CHGCAR") ? charge : potential;
 	out_file << '\n' << SizeVec(CHGPOT) << '\n';
-	out_file << fixed << showpos << scientific << setprecision(10);
-	for (uword i = 0; i < CHGPOT.n_elem; ++i) {
-		out_file << CHGPOT(i) << " ";
-		if (i % 5 == 4) {
-			out_file << '\n';
-		}
-	}
+	write_grid_values(out_file, CHGPOT);
 	out_file.close();
 }
 
@@ -235,6 +786,87 @@ void supercell::write_CHGCAR(const string& file_name) const {
 void supercell::write_LOCPOT(const string& file_name) const {
 	write_CHGPOT("LOCPOT", file_name);
 }
+output_queue::output_queue(const size_t writers_number, const size_t max_snapshot_bytes) : max_snapshot_bytes(max_snapshot_bytes) {
+	for (size_t i = 0; i < std::max(writers_number, size_t(1)); ++i) {
+		writers.emplace_back(&output_queue::write_files, this);
+	}
+}
+
+output_queue::~output_queue() {
+	{
+		lock_guard<mutex> lock(queue_mutex);
+		stopped = true;
+	}
+	queue_condition.notify_all();
+	for (auto& writer_thread : writers) {
+		writer_thread.join();
+	}
+}
+
+void output_queue::push(const shared_ptr<const supercell>& snapshot, const writer write, const string& file_name) {
+	const size_t grid_bytes = (snapshot->charge.n_elem + snapshot->potential.n_elem) * sizeof(double);
+	unique_lock<mutex> lock(queue_mutex);
+	if (snapshot_jobs.count(snapshot.get()) == 0) {
+		//a snapshot larger than the limit is queued when the queue is empty
+		queue_condition.wait(lock, [&] { return (snapshot_bytes == 0) || (snapshot_bytes + grid_bytes <= max_snapshot_bytes); });
+		snapshot_bytes += grid_bytes;
+	}
+	++snapshot_jobs[snapshot.get()];
+	jobs.push_back({ snapshot, write, file_name });
+	queue_condition.notify_all();
+}
+
+void output_queue::wait() {
+	auto log = spdlog::get("loggers");
+	unique_lock<mutex> lock(queue_mutex);
+	queue_condition.wait(lock, [this] { return jobs.empty() && (running_jobs == 0); });
+	if (files_written > 0) {
+		log->debug("{} output files ({:.1f} MB) written in {:.2f} s ({:.1f} MB/s)", files_written, bytes_written / 1e6, busy_time, bytes_written / 1e6 / std::max(busy_time, 1e-9));
+	}
+	files_written = 0;
+	bytes_written = 0;
+	busy_time = 0;
+}
+
+void output_queue::write_files() {
+	auto log = spdlog::get("loggers");
+	unique_lock<mutex> lock(queue_mutex);
+	while (true) {
+		queue_condition.wait(lock, [this] { return stopped || !jobs.empty(); });
+		if (jobs.empty()) {
+			return;
+		}
+		job current = move(jobs.front());
+		jobs.pop_front();
+		if (running_jobs++ == 0) {
+			busy_start = chrono::steady_clock::now();
+		}
+		lock.unlock();
+
+		const auto begin = chrono::steady_clock::now();
+		((*current.snapshot).*current.write)(current.file_name);
+		const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+		const uint64_t file_size = file_status(current.file_name).size;
+		log->trace("Finished writing {}: {:.1f} MB in {:.2f} s", current.file_name, file_size / 1e6, elapsed);
+
+		//the last job of a snapshot releases its memory
+		const supercell* const snapshot = current.snapshot.get();
+		const size_t grid_bytes = (snapshot->charge.n_elem + snapshot->potential.n_elem) * sizeof(double);
+
+		lock.lock();
+		if (--snapshot_jobs.at(snapshot) == 0) {
+			snapshot_jobs.erase(snapshot);
+			snapshot_bytes -= grid_bytes;
+		}
+		if (--running_jobs == 0) {
+			busy_time += chrono::duration<double>(chrono::steady_clock::now() - busy_start).count();
+		}
+		++files_written;
+		bytes_written += file_size;
+		queue_condition.notify_all();
+	}
+}
+
 void write_planar_avg(const cube& potential_data, const cube& charge_data, const string& id, const rowvec3& coordinate_vectors, const int direction) {
 	auto log = spdlog::get("loggers");
 	unsigned int direction_first = 0;
@@ -245,9 +877,10 @@ void write_planar_avg(const cube& potential_data, const cube& charge_data, const
 		direction_last = direction;
 	}
 
+	const auto sums = planar_sums({ &potential_data, &charge_data });
 	for (unsigned int dir = direction_first; dir <= direction_last; ++dir) {
-		auto avg_pot = planar_average(dir, potential_data);
-		const auto avg_chg = planar_average(dir, charge_data);
+		vec avg_pot = sums.at(0).at(dir);
+		const vec& avg_chg = sums.at(1).at(dir);
 		const auto pot_normalization = static_cast<double>(avg_pot.n_elem) / potential_data.n_elem;
 		avg_pot *= pot_normalization;
 
@@ -270,9 +903,14 @@ void write_planar_avg(const cube& potential_data, const cube& charge_data, const
 	}
 }
 
-void check_slabcc_compatiblity(const supercell& Neutral_supercell, const supercell& Charged_supercell) {
+void check_slabcc_compatiblity(const VASP_grid_file& CHGCAR_neutral, const VASP_grid_file& CHGCAR_charged, const VASP_grid_file& LOCPOT_neutral, const VASP_grid_file& LOCPOT_charged) {
 
 	auto log = spdlog::get("loggers");
+	const supercell& Neutral_supercell = CHGCAR_neutral.structure;
+	const supercell& Charged_supercell = CHGCAR_charged.structure;
+	const auto grid_size = [](const VASP_grid_file& file) -> urowvec3 {
+		return file.datasets.empty() ? urowvec3{ 0, 0, 0 } : file.datasets.front().grid;
+	};
 
 	// equal size
 	if (!approx_equal(Neutral_supercell.cell_vectors * Neutral_supercell.scaling,
@@ -297,14 +935,15 @@ void check_slabcc_compatiblity(const supercell& Neutral_supercell, const superce
 	}
 
 	// equal grid
-	const SizeCube input_grid = arma::size(Neutral_supercell.potential);
-	if ((input_grid != arma::size(Charged_supercell.potential)) ||
-		(input_grid != arma::size(Charged_supercell.charge)) ||
-		(input_grid != arma::size(Neutral_supercell.charge))) {
-		log->debug("Neutral CHGCAR grid: " + to_string(arma::size(Neutral_supercell.charge)));
-		log->debug("Neutral LOCPOT grid: " + to_string(arma::size(Neutral_supercell.potential)));
-		log->debug("Charged CHGCAR grid: " + to_string(arma::size(Charged_supercell.charge)));
-		log->debug("Charged LOCPOT grid: " + to_string(arma::size(Charged_supercell.potential)));
+	const urowvec3 input_grid = grid_size(LOCPOT_neutral);
+	if (any(input_grid == 0) ||
+		any(input_grid != grid_size(LOCPOT_charged)) ||
+		any(input_grid != grid_size(CHGCAR_charged)) ||
+		any(input_grid != grid_size(CHGCAR_neutral))) {
+		log->debug("Neutral CHGCAR grid: " + to_string(grid_size(CHGCAR_neutral)));
+		log->debug("Neutral LOCPOT grid: " + to_string(grid_size(LOCPOT_neutral)));
+		log->debug("Charged CHGCAR grid: " + to_string(grid_size(CHGCAR_charged)));
+		log->debug("Charged LOCPOT grid: " + to_string(grid_size(LOCPOT_charged)));
 		log->critical("Grid size of the data in CHGCAR/LOCPOT files does not match!");
 		finalize_loggers();
 		exit(1);
@@ -58,9 +58,16 @@ struct supercell {
 	cube potential;			//total potential (VASP LOCPOT * -1)
 
 
+	supercell() = default;
+
 	//generates a supercell and loads its data the POSCAR file
+	//the file can also be compressed or a VASP HDF5 file (vaspout.h5)
 	explicit supercell(const string& file_name);
 
+	//generates a supercell from the POSCAR data in the stream
+	//file_name is only used for the messages
+	supercell(istream& infile, const string& file_name);
+
 	//shifts the whole supercell (positions, charge, potential) by pos_shift as relative shift vector [0 1]
 	void shift(const rowvec3& pos_shift);
 
@@ -70,8 +77,18 @@ struct supercell {
 	void write_CHGCAR(const string& file_name) const;
 	void write_LOCPOT(const string& file_name) const;
 
+	//writes the structure, the charge and the potential to an HDF5 file in the same layout as the vaspout.h5
+	//(results/positions, charge/charge, results/potential/total) with the CHGCAR/LOCPOT conventions
+	void write_HDF5(const string& file_name) const;
+
 
 private:
+	//reads the POSCAR data from the stream
+	void read_POSCAR(istream& infile, const string& file_name);
+
+	//reads the structure from the results/positions group of a VASP HDF5 file
+	void read_HDF5(const string& file_name);
+
 	//type: "CHGCAR", "LOCPOT"
 	void write_CHGPOT(const string& type, const string& file_name) const;
 
@@ -83,13 +100,138 @@ private:
 };
 
 
+//index of the data blocks inside a CHGCAR/LOCPOT file which is built by a single scan of the file
+//only the POSCAR part is parsed during the scan. The grid datasets are located using their fixed line length
+//(or by counting their values if the lines are not uniform) and are parsed only on request.
+//with use_cache, the structure and the 1st dataset are stored after the first parse in a binary sidecar file
+//(file_name + ".slabcc_cache") which is keyed by the full path, size and modification time of the source file.
+//the next runs map the cache instead of parsing the text, so the processes on the same node share its pages.
+//gzip/xz/zstd compressed files are decompressed while being parsed. Only their 1st dataset is indexed.
+//for the VASP HDF5 files, the type ("CHGCAR"/"LOCPOT") selects the charge/charge or results/potential/total grid
+//and each of its spin components is a dataset. HDF5 files are not cached.
+struct VASP_grid_file {
+	//byte offsets of a block in the mapped file (source or its cache) as [begin end)
+	struct block {
+		size_t begin = 0;
+		size_t end = 0;
+	};
+
+	struct dataset {
+		urowvec3 grid = { 0, 0, 0 };
+		block data;						//grid data values
+		uword values_per_line = 0;		//layout of the text lines if all of them have the same length, otherwise 0
+		size_t line_length = 0;
+		size_t field_width = 0;
+		vector<block> augmentation;		//augmentation occupancies after the grid data (CHGCAR only)
+	};
+
+	string file_name;
+
+	//POSCAR part of the file
+	supercell structure;
+	block structure_block;
+
+	//1st dataset: total charge (spin 1+2) or total potential
+	//2nd dataset (spin-polarized calculations): magnetization (spin 1-2) in CHGCAR, or the 2nd spin component in LOCPOT
+	vector<dataset> datasets;
+
+	explicit VASP_grid_file(const string& file_name, const bool use_cache = false, const string& type = "CHGCAR");
+
+	bool is_open() const noexcept;
+
+	//data is read from the cache file
+	bool is_cached() const noexcept { return cached; }
+
+	//parses the grid data of the requested dataset
+	//the cube of a cached dataset uses the (copy-on-write) memory of the cache file and must not outlive this object
+	cube load_dataset(const uword index = 0) const;
+
+	//a part of a dataset can be read directly (cached data or text lines with fixed length)
+	bool is_seekable(const uword index) const noexcept;
+
+	//parses "count" values of a seekable dataset starting from the value number "first"
+	//returns the number of the values read
+	uword read_values(const uword index, const uword first, const uword count, double* values) const;
+
+private:
+	shared_ptr<const mapped_file> file;		//source file or its cache
+	bool use_cache = false;
+	bool cached = false;
+	bool compressed = false;
+	string compressed_head;		//decompressed text of a compressed file until its grid data
+	string HDF5_dataset;		//path of the grid in an HDF5 file
+	file_status source_status;
+
+	//parses the POSCAR part of the file
+	bool read_structure(const char* begin, const char* end);
+
+	//maps the cache file if it is valid for the source file
+	bool read_cache();
+
+	//stores the structure and the data of the 1st dataset in the cache file
+	void write_cache(const cube& data) const;
+};
+
+//background writer of the output files of the supercells
+//each queued file holds a shared snapshot of its (immutable) supercell, so queuing several files of the same supercell does not copy it.
+//the files are written by a fixed number of writer threads and push() waits while the queued snapshots exceed max_snapshot_bytes of grid data.
+struct output_queue {
+	using writer = void (supercell::*)(const string&) const;
+
+	explicit output_queue(const size_t writers_number = 2, const size_t max_snapshot_bytes = size_t(1) << 30);
+	~output_queue();
+	output_queue(const output_queue&) = delete;
+	output_queue& operator=(const output_queue&) = delete;
+
+	//queues the file to be written by write (e.g. &supercell::write_CHGCAR)
+	void push(const shared_ptr<const supercell>& snapshot, const writer write, const string& file_name);
+
+	//waits until all the queued files are written and reports their throughput
+	void wait();
+
+private:
+	struct job {
+		shared_ptr<const supercell> snapshot;
+		writer write;
+		string file_name;
+	};
+
+	deque<job> jobs;
+	unordered_map<const supercell*, size_t> snapshot_jobs;		//number of the queued and running jobs of each snapshot
+	size_t snapshot_bytes = 0;
+	size_t max_snapshot_bytes;
+	size_t running_jobs = 0;
+	size_t files_written = 0;
+	uint64_t bytes_written = 0;
+	chrono::steady_clock::time_point busy_start;	//since when at least one file is being written
+	double busy_time = 0;
+	bool stopped = false;
+	mutex queue_mutex;
+	condition_variable queue_condition;
+	vector<thread> writers;
+
+	void write_files();
+};
+
+//grid sizes of the spin components of a grid (e.g. "charge/charge") in a VASP HDF5 file
+//returns an empty vector if the grid does not exist
+vector<urowvec3> read_HDF5_grid_sizes(const string& file_name, const string& dataset_path);
+
+//reads a spin component of a grid from a VASP HDF5 file in chunks of the slices
+cube read_HDF5_grid(const string& file_name, const string& dataset_path, const uword component = 0);
+
 //reads grid data from CHGCAR/LOCPOT files and return ONLY the first data set (spin 1+2)
 //NOT SUITABLE FOR GENERAL PURPOSE APPLICATIONS!
 cube read_VASP_grid_data(const string& file_name);
 
+//reads the 1st datasets of both files in lockstep and returns (minuend - subtrahend) * scale
+//which is shifted by the relative_shift [0 1] in the same way as shift()
+//neither of the datasets is kept in the memory if both are seekable
+cube read_VASP_grid_difference(const VASP_grid_file& minuend, const VASP_grid_file& subtrahend, const rowvec3& relative_shift, const double scale = 1);
+
 //Write planar average of potential and charge to files 
 //coordinate_vectors (Bohr)
 void write_planar_avg(const cube& potential_data, const cube& charge_data, const string& id, const rowvec3& coordinate_vectors, const int direction = -1);
 
 //check conditions and consistency of the supercell grid sizes and the shape
-void check_slabcc_compatiblity(const supercell& Neutral_supercell, const supercell& Charged_supercell);
\ No newline at end of file
+void check_slabcc_compatiblity(const VASP_grid_file& CHGCAR_neutral, const VASP_grid_file& CHGCAR_charged, const VASP_grid_file& LOCPOT_neutral, const VASP_grid_file& LOCPOT_charged);
\ No newline at end of file
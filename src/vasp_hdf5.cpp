@@ -0,0 +1,339 @@
+// Copyright (c) 2018-2019, University of Bremen, M. Farzalipour Tabriz
+// Copyrights licensed under the 2-Clause BSD License.
+// See the accompanying LICENSE.txt file for terms.
+
+#include "vasp.hpp"
+#include <mutex>
+
+#ifdef HDF5
+#include <hdf5.h>
+#endif
+
+// VASP HDF5 files (vaspout.h5):
+// results/positions/lattice_vectors		3x3, one vector per row
+// results/positions/scale				scaling factor
+// results/positions/ion_types			name of the atom types
+// results/positions/number_ion_types	number of the atoms of each type
+// results/positions/position_ions		N x 3
+// results/positions/direct_coordinates	1: direct, 0: cartesian
+// charge/charge						[spin][z][y][x] (CHGCAR convention)
+// results/potential/total				[spin][z][y][x] (LOCPOT convention)
+
+#ifdef HDF5
+namespace {
+	//the HDF5 library is not thread-safe in its default build
+	mutex HDF5_mutex;
+
+	//closes an HDF5 object at the end of its scope
+	struct HDF5_handle {
+		HDF5_handle(const hid_t id, herr_t(*close)(hid_t)) noexcept : id(id), close(close) {}
+		~HDF5_handle() { if (id >= 0) close(id); }
+		HDF5_handle(const HDF5_handle&) = delete;
+		HDF5_handle& operator=(const HDF5_handle&) = delete;
+		operator hid_t() const noexcept { return id; }
+		bool is_valid() const noexcept { return id >= 0; }
+
+	private:
+		const hid_t id;
+		herr_t(*close)(hid_t);
+	};
+
+	//opens the file for reading and disables the HDF5's own error messages
+	hid_t open_HDF5_file(const string& file_name) {
+		H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+		return H5Fopen(file_name.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	}
+
+	//checks all the links in the path
+	bool path_exists(const hid_t file, const string& path) {
+		size_t end = 0;
+		do {
+			end = path.find('/', end + 1);
+			if (H5Lexists(file, path.substr(0, end).c_str(), H5P_DEFAULT) <= 0) {
+				return false;
+			}
+		} while (end != string::npos);
+		return true;
+	}
+
+	vector<hsize_t> dataset_dimensions(const hid_t dataset) {
+		const HDF5_handle space(H5Dget_space(dataset), H5Sclose);
+		vector<hsize_t> dims(std::max(0, H5Sget_simple_extent_ndims(space)));
+		H5Sget_simple_extent_dims(space, dims.data(), nullptr);
+		return dims;
+	}
+
+	//reads a whole dataset with the conversion to the memory type
+	template <typename T>
+	vector<T> read_values(const hid_t file, const string& path, const hid_t memory_type) {
+		const HDF5_handle dataset(H5Dopen2(file, path.c_str(), H5P_DEFAULT), H5Dclose);
+		if (!dataset.is_valid()) {
+			return {};
+		}
+		const HDF5_handle space(H5Dget_space(dataset), H5Sclose);
+		vector<T> values(std::max<hssize_t>(0, H5Sget_simple_extent_npoints(space)));
+		if (H5Dread(dataset, memory_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values.data()) < 0) {
+			return {};
+		}
+		return values;
+	}
+
+	//reads the fixed or variable length strings of a dataset
+	vector<string> read_strings(const hid_t file, const string& path) {
+		const HDF5_handle dataset(H5Dopen2(file, path.c_str(), H5P_DEFAULT), H5Dclose);
+		if (!dataset.is_valid()) {
+			return {};
+		}
+		const HDF5_handle file_type(H5Dget_type(dataset), H5Tclose);
+		const HDF5_handle space(H5Dget_space(dataset), H5Sclose);
+		const size_t strings_number = std::max<hssize_t>(0, H5Sget_simple_extent_npoints(space));
+		vector<string> strings;
+		if (H5Tis_variable_str(file_type) > 0) {
+			const HDF5_handle memory_type(H5Tcopy(H5T_C_S1), H5Tclose);
+			H5Tset_size(memory_type, H5T_VARIABLE);
+			vector<char*> buffers(strings_number, nullptr);
+			if (H5Dread(dataset, memory_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffers.data()) >= 0) {
+				for (const auto& buffer : buffers) {
+					strings.push_back(buffer ? buffer : "");
+				}
+				H5Dvlen_reclaim(memory_type, space, H5P_DEFAULT, buffers.data());
+			}
+		}
+		else {
+			const size_t string_size = H5Tget_size(file_type);
+			const HDF5_handle memory_type(H5Tcopy(H5T_C_S1), H5Tclose);
+			H5Tset_size(memory_type, string_size);
+			H5Tset_strpad(memory_type, H5T_STR_NULLPAD);
+			vector<char> buffer(strings_number * string_size);
+			if (H5Dread(dataset, memory_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data()) >= 0) {
+				for (size_t i = 0; i < strings_number; ++i) {
+					strings.emplace_back(buffer.data() + i * string_size, string_size);
+				}
+			}
+		}
+
+		//fixed length strings are padded with spaces or nulls
+		for (auto& text : strings) {
+			text.erase(text.find_last_not_of(string(" \0", 2)) + 1);
+		}
+		return strings;
+	}
+
+	//creates a dataset (and its parent groups) with the given dimensions and writes the data in one call
+	bool write_values(const hid_t file, const string& path, const vector<hsize_t>& dims, const hid_t file_type, const hid_t memory_type, const void* data) {
+		const HDF5_handle link_properties(H5Pcreate(H5P_LINK_CREATE), H5Pclose);
+		H5Pset_create_intermediate_group(link_properties, 1);
+		const HDF5_handle space(dims.empty() ? H5Screate(H5S_SCALAR) : H5Screate_simple(static_cast<int>(dims.size()), dims.data(), nullptr), H5Sclose);
+		const HDF5_handle dataset(H5Dcreate2(file, path.c_str(), file_type, space, link_properties, H5P_DEFAULT, H5P_DEFAULT), H5Dclose);
+		return dataset.is_valid() && (H5Dwrite(dataset, memory_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data) >= 0);
+	}
+
+	bool write_strings(const hid_t file, const string& path, const vector<string>& strings, const bool scalar) {
+		size_t string_size = 1;
+		for (const auto& text : strings) {
+			string_size = std::max(string_size, text.size());
+		}
+		vector<char> buffer(strings.size() * string_size, ' ');
+		for (size_t i = 0; i < strings.size(); ++i) {
+			copy(strings.at(i).begin(), strings.at(i).end(), buffer.begin() + i * string_size);
+		}
+		const HDF5_handle string_type(H5Tcopy(H5T_C_S1), H5Tclose);
+		H5Tset_size(string_type, string_size);
+		H5Tset_strpad(string_type, H5T_STR_SPACEPAD);
+		const vector<hsize_t> dims = scalar ? vector<hsize_t>{} : vector<hsize_t>{ strings.size() };
+		return write_values(file, path, dims, string_type, string_type, buffer.data());
+	}
+}
+#endif
+
+void supercell::read_HDF5(const string& file_name) {
+	auto log = spdlog::get("loggers");
+#ifdef HDF5
+	const string positions = "results/positions/";
+	string structure_file = file_name;
+	{
+		lock_guard<mutex> lock(HDF5_mutex);
+		const HDF5_handle file(open_HDF5_file(file_name), H5Fclose);
+		if (!file.is_valid()) {
+			log->critical("Could not open the " + file_name);
+			return;
+		}
+
+		//vaspwave.h5 does not contain the structure, it is in the vaspout.h5 next to it
+		if (!path_exists(file, positions + "position_ions")) {
+			const auto directory_end = file_name.find_last_of("/\\");
+			structure_file = (directory_end == string::npos ? "" : file_name.substr(0, directory_end + 1)) + "vaspout.h5";
+			log->debug("No structure found in {}. It will be read from {}", file_name, structure_file);
+		}
+	}
+
+	lock_guard<mutex> lock(HDF5_mutex);
+	const HDF5_handle file(open_HDF5_file(structure_file), H5Fclose);
+	if (!file.is_valid() || !path_exists(file, positions + "position_ions")) {
+		log->critical("Could not read the structure from " + structure_file);
+		return;
+	}
+
+	const auto system = read_strings(file, positions + "system");
+	label = system.empty() ? file_name : system.front();
+	const auto scale = read_values<double>(file, positions + "scale", H5T_NATIVE_DOUBLE);
+	scaling = scale.empty() ? 1.0 : scale.front();
+
+	//row-major vectors in the file are the columns of the cell_vectors
+	const auto lattice_vectors = read_values<double>(file, positions + "lattice_vectors", H5T_NATIVE_DOUBLE);
+	if (lattice_vectors.size() != cell_vectors.n_elem) {
+		log->critical("Incorrect lattice vectors in " + structure_file);
+		return;
+	}
+	copy(lattice_vectors.begin(), lattice_vectors.end(), cell_vectors.begin());
+
+	const auto types = read_strings(file, positions + "ion_types");
+	const auto numbers = read_values<int>(file, positions + "number_ion_types", H5T_NATIVE_INT);
+	if (types.size() != numbers.size()) {
+		log->critical("Number of the atom types and their counts do not match in " + structure_file);
+		return;
+	}
+	for (size_t i = 0; i < types.size(); ++i) {
+		for (auto a = 0; a < numbers.at(i); ++a) {
+			atoms.type.push_back(types.at(i));
+			atoms.definition_order.push_back(i);
+		}
+	}
+	atoms_number = atoms.type.size();
+
+	const auto positions_data = read_values<double>(file, positions + "position_ions", H5T_NATIVE_DOUBLE);
+	if (positions_data.size() != 3 * atoms_number) {
+		log->critical("Incorrect atomic positions in " + structure_file);
+		return;
+	}
+	atoms.position = mat(positions_data.data(), 3, atoms_number).t();
+	atoms.constrains.resize(atoms_number, vector<bool>(3, 0));
+	selective_dynamics = false;
+
+	const auto direct = read_values<int>(file, positions + "direct_coordinates", H5T_NATIVE_INT);
+	coordination_system = (direct.empty() || (direct.front() != 0)) ? "direct" : "cartesian";
+
+	normalize_positions();
+#else
+	log->critical("Support for the HDF5 files is not enabled in this build (-DHDF5): " + file_name);
+#endif
+}
+
+vector<urowvec3> read_HDF5_grid_sizes(const string& file_name, const string& dataset_path) {
+	vector<urowvec3> grids;
+#ifdef HDF5
+	lock_guard<mutex> lock(HDF5_mutex);
+	const HDF5_handle file(open_HDF5_file(file_name), H5Fclose);
+	if (!file.is_valid() || !path_exists(file, dataset_path)) {
+		return grids;
+	}
+	const HDF5_handle dataset(H5Dopen2(file, dataset_path.c_str(), H5P_DEFAULT), H5Dclose);
+	const auto dims = dataset_dimensions(dataset);
+
+	//[z][y][x] or [spin][z][y][x]
+	if ((dims.size() == 3) || (dims.size() == 4)) {
+		const size_t components = (dims.size() == 4) ? dims.at(0) : 1;
+		const urowvec3 grid = { dims.at(dims.size() - 1), dims.at(dims.size() - 2), dims.at(dims.size() - 3) };
+		grids.resize(components, grid);
+	}
+#else
+	(void)dataset_path;
+	auto log = spdlog::get("loggers");
+	log->critical("Support for the HDF5 files is not enabled in this build (-DHDF5): " + file_name);
+#endif
+	return grids;
+}
+
+cube read_HDF5_grid(const string& file_name, const string& dataset_path, const uword component) {
+	auto log = spdlog::get("loggers");
+#ifdef HDF5
+	log->trace("Started reading {}:{}", file_name, dataset_path);
+	lock_guard<mutex> lock(HDF5_mutex);
+	const HDF5_handle file(open_HDF5_file(file_name), H5Fclose);
+	const HDF5_handle dataset(file.is_valid() ? H5Dopen2(file, dataset_path.c_str(), H5P_DEFAULT) : -1, H5Dclose);
+	if (!dataset.is_valid()) {
+		log->error("{} could not be found in {}", dataset_path, file_name);
+		return {};
+	}
+
+	const auto dims = dataset_dimensions(dataset);
+	if (((dims.size() != 3) && (dims.size() != 4)) || ((dims.size() == 4) && (component >= dims.at(0)))) {
+		log->error("{} in {} is not a valid grid", dataset_path, file_name);
+		return {};
+	}
+	const bool has_components = (dims.size() == 4);
+	const hsize_t nz = dims.at(dims.size() - 3);
+	const hsize_t ny = dims.at(dims.size() - 2);
+	const hsize_t nx = dims.at(dims.size() - 1);
+	cube data(nx, ny, nz);
+
+	//x is the fastest changing index in the file, so each z-slice is contiguous in the cube
+	const hsize_t slice_size = nx * ny;
+	const hsize_t chunk_slices = std::max<hsize_t>(1, (hsize_t(4) << 20) / slice_size);
+	const HDF5_handle file_space(H5Dget_space(dataset), H5Sclose);
+	for (hsize_t z = 0; z < nz; z += chunk_slices) {
+		const hsize_t slices = std::min(chunk_slices, nz - z);
+		const vector<hsize_t> start = has_components ? vector<hsize_t>{ component, z, 0, 0 } : vector<hsize_t>{ z, 0, 0 };
+		const vector<hsize_t> count = has_components ? vector<hsize_t>{ 1, slices, ny, nx } : vector<hsize_t>{ slices, ny, nx };
+		H5Sselect_hyperslab(file_space, H5S_SELECT_SET, start.data(), nullptr, count.data(), nullptr);
+		const hsize_t chunk_size = slices * slice_size;
+		const HDF5_handle memory_space(H5Screate_simple(1, &chunk_size, nullptr), H5Sclose);
+		if (H5Dread(dataset, H5T_NATIVE_DOUBLE, memory_space, file_space, H5P_DEFAULT, data.slice_memptr(z)) < 0) {
+			log->error("{} in {} could not be read properly", dataset_path, file_name);
+			return {};
+		}
+	}
+
+	return data;
+#else
+	(void)dataset_path;
+	(void)component;
+	log->critical("Support for the HDF5 files is not enabled in this build (-DHDF5): " + file_name);
+	return {};
+#endif
+}
+
+void supercell::write_HDF5(const string& file_name) const {
+	auto log = spdlog::get("loggers");
+	log->trace("Started writing " + file_name);
+#ifdef HDF5
+	const string positions = "results/positions/";
+
+	//consecutive atoms with the same definition order are of the same type, as in the POSCAR
+	vector<string> types;
+	vector<int> numbers;
+	for (uword i = 0; i < atoms_number; ++i) {
+		if ((i == 0) || (atoms.definition_order.at(i) != atoms.definition_order.at(i - 1))) {
+			types.push_back(atoms.type.at(i));
+			numbers.push_back(0);
+		}
+		++numbers.back();
+	}
+	const mat positions_data = atoms.position.t();
+	const int direct = (coordination_system == "direct") ? 1 : 0;
+
+	lock_guard<mutex> lock(HDF5_mutex);
+	H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+	const HDF5_handle file(H5Fcreate(file_name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT), H5Fclose);
+	bool written = file.is_valid();
+	written = written && write_strings(file, positions + "system", { label }, true);
+	written = written && write_values(file, positions + "scale", {}, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, &scaling);
+	written = written && write_values(file, positions + "lattice_vectors", { 3, 3 }, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, cell_vectors.memptr());
+	written = written && write_strings(file, positions + "ion_types", types, false);
+	written = written && write_values(file, positions + "number_ion_types", { numbers.size() }, H5T_STD_I32LE, H5T_NATIVE_INT, numbers.data());
+	written = written && write_values(file, positions + "position_ions", { atoms_number, 3 }, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, positions_data.memptr());
+	written = written && write_values(file, positions + "direct_coordinates", {}, H5T_STD_I32LE, H5T_NATIVE_INT, &direct);
+	if (!charge.is_empty()) {
+		written = written && write_values(file, "charge/charge", { 1, charge.n_slices, charge.n_cols, charge.n_rows }, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, charge.memptr());
+	}
+	if (!potential.is_empty()) {
+		written = written && write_values(file, "results/potential/total", { 1, potential.n_slices, potential.n_cols, potential.n_rows }, H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE, potential.memptr());
+	}
+
+	if (!written) {
+		log->error("Could not write the " + file_name);
+	}
+#else
+	log->critical("Support for the HDF5 files is not enabled in this build (-DHDF5): " + file_name);
+#endif
+}